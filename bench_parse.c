@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Microbenchmark of the text log tokenizer ("make bench").
+ *
+ * Compares the lines/sec of the original tokenizer (strtok, with every
+ * field copied into a malloc'ed string in a vector) with split_fields(),
+ * which slices the line in place, and of split_fields() plus parse_op().
+ * Also compares reading the log with getline() and with logfile_next().
+ * Usage: ./bench_parse [LOG] [PASSES]
+ */
+#include "replay.h"
+
+/* The original tokenizer, kept here as the baseline */
+static void legacy_extract_fields(vector_t *fields_vec, char *line, const char *delim)
+{
+    vector_init(fields_vec, char *);
+    char *field = strtok(line, delim);
+    while (field) {
+        size_t flen = strlen(field);
+        char *field_copy = malloc(flen + 1);
+        assert(field_copy);
+        memcpy(field_copy, field, flen + 1);
+        vector_add(fields_vec, &field_copy);
+        field = strtok(NULL, ", ");
+    }
+}
+
+static void legacy_destroy_fields(vector_t *fields_vec)
+{
+    char **field;
+    vector_iter(fields_vec, char *, field) {
+        free(*field);
+    }
+    vector_destroy(fields_vec);
+}
+
+enum bench_mode {
+    BENCH_LEGACY,
+    BENCH_SPLIT,
+    BENCH_SPLIT_PARSE,
+};
+
+static const char *bench_names[] = {
+    [BENCH_LEGACY] = "strtok+malloc",
+    [BENCH_SPLIT] = "split_fields",
+    [BENCH_SPLIT_PARSE] = "split_fields+parse_op",
+};
+
+/* Tokenize every line of @lines @passes times, returning the sink count */
+static uint64_t bench(enum bench_mode mode, char **lines, size_t nlines,
+                      int passes, double *secs)
+{
+    char linebuf[PATH_MAX];
+    uint64_t sink = 0;
+    uint64_t start = now_ns();
+
+    for (int p = 0; p < passes; ++p) {
+        for (size_t i = 0; i < nlines; ++i) {
+            /* Stand-in for getline() refilling its buffer */
+            strcpy(linebuf, lines[i]);
+            if (mode == BENCH_LEGACY) {
+                vector_t argvec;
+                legacy_extract_fields(&argvec, linebuf, ", ");
+                sink += argvec.len;
+                legacy_destroy_fields(&argvec);
+            } else {
+                struct fields argv;
+                sink += split_fields(&argv, linebuf, strlen(linebuf), ", ");
+                if (mode == BENCH_SPLIT_PARSE) {
+                    struct replay_op op;
+                    parse_op(&argv, &op);
+                    sink += op.opcode;
+                }
+            }
+        }
+    }
+    *secs = (now_ns() - start) / 1e9;
+    return sink;
+}
+
+/* Lines/sec of reading the whole log, with getline() or from a mapping */
+static void bench_reader(const char *logpath, int passes)
+{
+    uint64_t nlines = 0, sink = 0;
+    uint64_t start = now_ns();
+
+    for (int p = 0; p < passes; ++p) {
+        size_t linecap = 0;
+        char *linebuf = NULL;
+        FILE *fp = fopen(logpath, "r");
+        assert(fp);
+        while (getline(&linebuf, &linecap, fp) >= 0) {
+            sink += linebuf[0];
+            nlines++;
+        }
+        fclose(fp);
+        free(linebuf);
+    }
+    double secs = (now_ns() - start) / 1e9;
+    printf("%-22s %12.0f lines/sec (%lu)\n", "getline", nlines / secs,
+           (unsigned long)sink);
+
+    nlines = sink = 0;
+    start = now_ns();
+    for (int p = 0; p < passes; ++p) {
+        struct logfile lf;
+        const char *line;
+        size_t len;
+        if (logfile_open(&lf, logpath) != 0)
+            return;
+        while (logfile_next(&lf, &line, &len)) {
+            sink += line[0];
+            nlines++;
+        }
+        logfile_close(&lf);
+    }
+    secs = (now_ns() - start) / 1e9;
+    printf("%-22s %12.0f lines/sec (%lu)\n", "logfile_next", nlines / secs,
+           (unsigned long)sink);
+}
+
+int main(int argc, char **argv)
+{
+    const char *logpath = argc > 1 ? argv[1] : "jfs_op_sequence.log";
+    int passes = argc > 2 ? atoi(argv[2]) : 3;
+    size_t linecap = 0, nlines = 0, cap = 0;
+    char *linebuf = NULL, **lines = NULL;
+    ssize_t len;
+
+    FILE *fp = fopen(logpath, "r");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s (%s)\n", logpath, strerror(errno));
+        return 1;
+    }
+    while ((len = getline(&linebuf, &linecap, fp)) >= 0) {
+        if (len > 0 && linebuf[len - 1] == '\n')
+            linebuf[len - 1] = '\0';
+        if ((size_t)len >= PATH_MAX)
+            continue;
+        if (nlines == cap) {
+            cap = cap ? cap * 2 : 4096;
+            lines = realloc(lines, cap * sizeof(char *));
+            assert(lines);
+        }
+        lines[nlines++] = strdup(linebuf);
+    }
+    fclose(fp);
+    free(linebuf);
+
+    printf("%zu lines, %d passes\n", nlines, passes);
+    for (int mode = BENCH_LEGACY; mode <= BENCH_SPLIT_PARSE; ++mode) {
+        double secs;
+        uint64_t sink = bench(mode, lines, nlines, passes, &secs);
+        printf("%-22s %12.0f lines/sec (%lu)\n", bench_names[mode],
+               nlines * passes / secs, (unsigned long)sink);
+    }
+    bench_reader(logpath, passes);
+    return 0;
+}
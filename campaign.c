@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Multi-device campaigns ("replay --campaign N").
+ *
+ * The replayer forks N instances after loading the sequence. Instance K
+ * replays on its own device (/dev/ramK) and mount point
+ * (/mnt/test-jfs-iK-s0), pinned to the K-th CPU the replayer may run on,
+ * and writes its output to replay-iK-s0.log. The paths of the sequence
+ * are rebased from the original mount point onto the instance's. The
+ * parent waits for the instances, stops all of them as soon as one hits
+ * an oops, and prints a summary of all of them.
+ *
+ * A differential replay (lockstep.c) runs one instance per file system
+ * instead, e.g. ext4 on /dev/ram1 mounted on /mnt/test-ext4-i0-s1. Its
+ * instances wait for each other after every op, so all of them are
+ * stopped as soon as one fails.
+ */
+#include "replay.h"
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Progress of each instance, shared with the parent */
+struct campaign_status {
+    pid_t pid;
+    unsigned long iterations;   /* iterations completed */
+    int status;                 /* wait status once it has exited */
+    bool exited;
+    char device[PATH_MAX];
+};
+
+struct campaign_status *campaign_self;
+
+static struct campaign_status *instances;
+static int ninstances;
+
+static void campaign_stop(int sig)
+{
+    for (int k = 0; k < ninstances; ++k)
+        if (instances[k].pid > 0 && !instances[k].exited)
+            kill(instances[k].pid, sig);
+}
+
+static void forward_signal(int sig)
+{
+    campaign_stop(sig);
+}
+
+/* Called by an instance after every iteration */
+void campaign_progress(unsigned long iterations)
+{
+    if (campaign_self)
+        campaign_self->iterations = iterations;
+}
+
+/* @path with its last run of digits replaced by @k, e.g. /dev/ram0 */
+static void numbered(char *out, size_t size, const char *path, int k)
+{
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] >= '0' && path[len - 1] <= '9')
+        len--;
+    snprintf(out, size, "%.*s%d", (int)len, path, k);
+}
+
+/* Switch the globals of this process over to instance @k */
+static void campaign_instance(int k)
+{
+    static char dev[PATH_MAX], suffix[32], mnt[PATH_MAX], log[PATH_MAX];
+    size_t plen = strlen(basepath) - strlen(fssuffix);
+    size_t flen = strlen(fsys);
+
+    /* The mount point is named after the file system, e.g. /mnt/test-jfs */
+    if (plen >= flen && strncmp(basepath + plen - flen, fsys, flen) == 0)
+        plen -= flen;
+    if (lockstep_fs > 0) {
+        lockstep_join(k);
+        snprintf(dev, sizeof(dev), "%s", device);
+        snprintf(suffix, sizeof(suffix), "-i0-s%d", k);
+    } else {
+        numbered(dev, sizeof(dev), device, k);
+        snprintf(suffix, sizeof(suffix), "-i%d-s0", k);
+    }
+    snprintf(mnt, sizeof(mnt), "%.*s%s%s", (int)plen, basepath, fsys, suffix);
+    path_rebase(basepath, mnt);
+    device = dev;
+    fssuffix = suffix;
+    basepath = mnt;
+    strcpy(campaign_self->device, dev);
+
+    if (mkdir(basepath, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s (%s)\n", basepath, strerror(errno));
+        exit(1);
+    }
+
+    pin_cpu(k);
+
+    snprintf(log, sizeof(log), "replay%s.log", fssuffix);
+    if (!freopen(log, "w", stdout)) {
+        fprintf(stderr, "Cannot open %s (%s)\n", log, strerror(errno));
+        exit(1);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+static void campaign_summary(uint64_t elapsed_ns)
+{
+    unsigned long total = 0;
+
+    printf("%-10s %-16s %10s  %s\n", "instance", "device", "iterations", "result");
+    for (int k = 0; k < ninstances; ++k) {
+        struct campaign_status *c = &instances[k];
+        char result[64];
+
+        if (!c->exited)
+            snprintf(result, sizeof(result), "running");
+        else if (WIFSIGNALED(c->status))
+            snprintf(result, sizeof(result), "killed (%s)", strsignal(WTERMSIG(c->status)));
+        else if (WEXITSTATUS(c->status) == 2)
+            snprintf(result, sizeof(result), "kernel oops");
+        else if (WEXITSTATUS(c->status) == 3)
+            snprintf(result, sizeof(result), "model mismatch");
+        else if (WEXITSTATUS(c->status) == 4)
+            snprintf(result, sizeof(result), "diverged");
+        else if (WEXITSTATUS(c->status) != 0)
+            snprintf(result, sizeof(result), "failed (%d)", WEXITSTATUS(c->status));
+        else
+            snprintf(result, sizeof(result), "done");
+        printf("i%-9d %-16s %10lu  %s\n", k, c->device, c->iterations, result);
+        total += c->iterations;
+    }
+    printf("%d instances completed %lu iterations in %.1f seconds (%.2f per hour)\n",
+           ninstances, total, elapsed_ns / 1e9, total / (elapsed_ns / 3.6e12));
+}
+
+/*
+ * Fork @n instances. Returns in each instance, with the globals set up for
+ * it; the parent waits for all of them and exits with 2 if any of them
+ * hit a kernel oops, or with 4 if a differential replay diverged.
+ */
+void campaign_fork(int n)
+{
+    ninstances = n;
+    instances = mmap(NULL, n * sizeof(*instances), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (instances == MAP_FAILED) {
+        fprintf(stderr, "Cannot allocate campaign state (%s)\n", strerror(errno));
+        exit(1);
+    }
+    memset(instances, 0, n * sizeof(*instances));
+
+    uint64_t start = now_ns();
+    fflush(stdout);
+    for (int k = 0; k < n; ++k) {
+        if (lockstep_fs > 0)
+            snprintf(instances[k].device, sizeof(instances[k].device), "%s",
+                     lockstep_name(k));
+        else
+            numbered(instances[k].device, sizeof(instances[k].device), device, k);
+        pid_t pid = fork();
+        if (pid == 0) {
+            campaign_self = &instances[k];
+            campaign_instance(k);
+            return;
+        }
+        if (pid < 0) {
+            fprintf(stderr, "Cannot fork instance %d (%s)\n", k, strerror(errno));
+            campaign_stop(SIGTERM);
+            break;
+        }
+        instances[k].pid = pid;
+    }
+    printf("Started %d instances\n", n);
+    signal(SIGINT, forward_signal);
+    signal(SIGTERM, forward_signal);
+
+    bool oops = false, diverged = false, stopped = false;
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0 || errno == EINTR) {
+        if (pid <= 0)
+            continue;
+        for (int k = 0; k < n; ++k) {
+            if (instances[k].pid != pid)
+                continue;
+            instances[k].exited = true;
+            instances[k].status = status;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 2 && !oops) {
+                /* The kernel is in trouble; the other instances are done */
+                printf("Instance %d hit a kernel oops, stopping the campaign\n", k);
+                oops = true;
+                campaign_stop(SIGTERM);
+            }
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 4)
+                diverged = true;
+            if (lockstep_fs > 0 && !stopped && !oops &&
+                (!WIFEXITED(status) || (WEXITSTATUS(status) != 0 &&
+                                        WEXITSTATUS(status) < 3))) {
+                /* The others would wait for it forever */
+                printf("Instance %d failed, stopping the differential replay\n", k);
+                stopped = true;
+                campaign_stop(SIGTERM);
+            }
+        }
+    }
+    campaign_summary(now_ns() - start);
+    exit(oops ? 2 : stopped ? 1 : diverged ? 4 : 0);
+}
@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Sequence to C compiler ("replay --emit-c OUT").
+ *
+ * Translates the sequence, or a range of it, into a C program that
+ * replays it in a straight line: every op is a syscall with constant
+ * arguments, and mounts and unmounts are placed where the mount policy
+ * would put them. The program needs nothing but libc, prints the same
+ * output as the replayer, and is small enough to attach to a bug report.
+ *
+ * The ops are split into functions of EMIT_CHUNK ops each, which main()
+ * calls in order, so that a whole sequence of a million ops does not end
+ * up as a single function the compiler cannot cope with.
+ */
+#include "replay.h"
+
+#define EMIT_CHUNK          100     /* ops per generated function */
+
+/* Write @s as a C string literal */
+static void emit_str(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            fprintf(out, "\\%03o", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static const char emit_includes[] =
+    "#define _GNU_SOURCE\n"
+    "#include <errno.h>\n"
+    "#include <fcntl.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "#include <unistd.h>\n"
+    "#include <sys/mount.h>\n"
+    "#include <sys/stat.h>\n"
+    "#include <sys/types.h>\n"
+    "#include <sys/xattr.h>\n"
+    "\n";
+
+/* Helpers of the generated program, after its configuration */
+static const char emit_helpers[] =
+    "static void mount_fs(void)\n"
+    "{\n"
+    "    if (mount(device, mountpoint, fstype, MS_NOATIME, \"\") != 0) {\n"
+    "        fprintf(stderr, \"Could not mount %s on %s (%s)\\n\", device,\n"
+    "                mountpoint, strerror(errno));\n"
+    "        exit(1);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void unmount_fs(void)\n"
+    "{\n"
+    "    while (umount2(mountpoint, 0) != 0) {\n"
+    "        if (errno != EBUSY) {\n"
+    "            fprintf(stderr, \"Could not unmount %s (%s)\\n\", mountpoint,\n"
+    "                    strerror(errno));\n"
+    "            exit(1);\n"
+    "        }\n"
+    "        usleep(1000);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "/* Pre-populated files and directories may already exist */\n"
+    "static void prep_dir(const char *path)\n"
+    "{\n"
+    "    if (mkdir(path, 0755) != 0 && errno != EEXIST) {\n"
+    "        fprintf(stderr, \"Cannot create %s (%s)\\n\", path, strerror(errno));\n"
+    "        exit(1);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void prep_file(const char *path)\n"
+    "{\n"
+    "    int fd = creat(path, 0644);\n"
+    "    if (fd >= 0) {\n"
+    "        close(fd);\n"
+    "    } else if (errno != EEXIST) {\n"
+    "        fprintf(stderr, \"Cannot create %s (%s)\\n\", path, strerror(errno));\n"
+    "        exit(1);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "/* Start op @n, after it mounted the file system */\n"
+    "static void seq(unsigned long n)\n"
+    "{\n"
+    "    printf(\"seq=%lu \\n\", n);\n"
+    "    errno = 0;\n"
+    "}\n"
+    "\n"
+    "static void report(const char *call, long ret)\n"
+    "{\n"
+    "    printf(\"%s -> ret=%d, errno=%s\\n\", call, (int)ret, strerror(errno));\n"
+    "}\n"
+    "\n"
+    "static int create_file(const char *path, int flags, mode_t mode)\n"
+    "{\n"
+    "    int fd = open(path, flags, mode);\n"
+    "    if (fd < 0)\n"
+    "        return -1;\n"
+    "    close(fd);\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "static ssize_t write_file(const char *path, int flags, int c, off_t offset,\n"
+    "                          size_t length)\n"
+    "{\n"
+    "    int fd = open(path, flags, O_RDWR);\n"
+    "    ssize_t ret = -1;\n"
+    "    int err;\n"
+    "    if (fd < 0)\n"
+    "        return -1;\n"
+    "    memset(buf, c, length);\n"
+    "    if (lseek(fd, offset, SEEK_SET) != (off_t)-1)\n"
+    "        ret = write(fd, buf, length);\n"
+    "    err = errno;\n"
+    "    close(fd);\n"
+    "    errno = err;\n"
+    "    return ret;\n"
+    "}\n"
+    "\n";
+
+/* Mount state of the generated program, following the mount policy */
+static struct {
+    bool mounted;
+    unsigned long since_mount;
+    enum op_code group;
+} emit_policy;
+
+static void emit_pre_op(FILE *out, enum op_code opcode)
+{
+    if (emit_policy.mounted && mount_policy == MOUNT_PER_GROUP &&
+        opcode != emit_policy.group) {
+        fprintf(out, "    unmount_fs();\n");
+        emit_policy.mounted = false;
+    }
+    if (!emit_policy.mounted) {
+        fprintf(out, "    mount_fs();\n");
+        emit_policy.mounted = true;
+        emit_policy.since_mount = 0;
+    }
+    emit_policy.group = opcode;
+}
+
+static void emit_post_op(FILE *out)
+{
+    emit_policy.since_mount++;
+    if (mount_policy == MOUNT_PER_OP ||
+        (mount_policy == MOUNT_EVERY_N && emit_policy.since_mount >= mount_every)) {
+        fprintf(out, "    unmount_fs();\n");
+        emit_policy.mounted = false;
+    }
+}
+
+/* The same steps as mkdir_p() for pre-populated entry @path */
+static void emit_prepopulate(FILE *out, const char *path)
+{
+    char prefix[PATH_MAX];
+    bool next_f = false, next_d = false;
+
+    for (size_t i = 1; path[i]; ++i) {
+        if (path[i] != '/')
+            continue;
+        memcpy(prefix, path, i);
+        prefix[i] = '\0';
+        fprintf(out, "    prep_dir(");
+        emit_str(out, prefix);
+        fprintf(out, ");\n");
+        if (path[i + 1] == 'f')
+            next_f = true;
+        else if (path[i + 1] == 'd')
+            next_d = true;
+    }
+    if (next_f) {
+        fprintf(out, "    prep_file(");
+        emit_str(out, path);
+        fprintf(out, ");\n");
+    }
+    if (next_d) {
+        fprintf(out, "    prep_dir(");
+        emit_str(out, path);
+        fprintf(out, ");\n");
+    }
+}
+
+/* The syscall of @op with constant arguments, as an expression */
+static void emit_call(FILE *out, const struct replay_op *op, unsigned long seq)
+{
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        fprintf(out, "create_file(");
+        emit_str(out, op->path);
+        fprintf(out, ", 0%o, 0%o)", op->flags, op->mode);
+        break;
+    case OP_WRITE_FILE:
+        /* The same data as fill_write_data() */
+        fprintf(out, "write_file(");
+        emit_str(out, op->path);
+        fprintf(out, ", 0%o, %lu, %ld, %zu)", op->flags,
+                (seq / n_fs) & 0xff, (long)op->offset, op->length);
+        break;
+    case OP_TRUNCATE:
+        fprintf(out, "truncate(");
+        emit_str(out, op->path);
+        fprintf(out, ", %ld)", (long)op->length);
+        break;
+    case OP_MKDIR:
+        fprintf(out, "mkdir(");
+        emit_str(out, op->path);
+        fprintf(out, ", 0%o)", op->mode);
+        break;
+    case OP_RMDIR:
+        fprintf(out, "rmdir(");
+        emit_str(out, op->path);
+        fprintf(out, ")");
+        break;
+    case OP_UNLINK:
+        fprintf(out, "unlink(");
+        emit_str(out, op->path);
+        fprintf(out, ")");
+        break;
+    case OP_SYMLINK:
+    case OP_LINK:
+        fprintf(out, "%s(", op->opcode == OP_SYMLINK ? "symlink" : "link");
+        emit_str(out, op->path);
+        fprintf(out, ", ");
+        emit_str(out, op->path2);
+        fprintf(out, ")");
+        break;
+    case OP_CHMOD:
+        fprintf(out, "chmod(");
+        emit_str(out, op->path);
+        fprintf(out, ", 0%o)", op->mode);
+        break;
+    case OP_CHOWN:
+    case OP_CHGRP:
+        fprintf(out, "chown(");
+        emit_str(out, op->path);
+        if (op->opcode == OP_CHOWN)
+            fprintf(out, ", %u, -1)", op->mode);
+        else
+            fprintf(out, ", -1, %u)", op->mode);
+        break;
+    case OP_SETXATTR:
+    {
+        size_t vlen = strlen(op->value) + 1;
+        fprintf(out, "setxattr(");
+        emit_str(out, op->path);
+        fprintf(out, ", ");
+        emit_str(out, op->path2);
+        /* Pad the value with zeros if the size goes past its end */
+        fprintf(out, ", (const char[%zu]){", max(vlen, op->length));
+        emit_str(out, op->value);
+        fprintf(out, "}, %zu, %d)", op->length, op->flags);
+        break;
+    }
+    case OP_REMOVEXATTR:
+        fprintf(out, "removexattr(");
+        emit_str(out, op->path);
+        fprintf(out, ", ");
+        emit_str(out, op->path2);
+        fprintf(out, ")");
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Write a C program replaying ops @first to @last (inclusive) of @ops to
+ * @file. @source names the sequence in the generated comment.
+ */
+int emit_c(const char *file, const char *source, const struct replay_op *ops,
+           size_t nops, size_t first, size_t last)
+{
+    size_t bufsize = 1;
+    char call[3 * PATH_MAX];
+
+    if (nops == 0 || first > last || first >= nops) {
+        fprintf(stderr, "Invalid range %zu-%zu of a %zu-op sequence\n",
+                first, last, nops);
+        return -1;
+    }
+    last = min(last, nops - 1);
+
+    FILE *out = fopen(file, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot open %s (%s)\n", file, strerror(errno));
+        return -1;
+    }
+    for (size_t n = first; n <= last; ++n) {
+        if (ops[n].opcode == OP_WRITE_FILE)
+            bufsize = max(bufsize, ops[n].length);
+    }
+
+    fprintf(out, "/*\n"
+            " * Replay of seq %zu to %zu of %s, generated by\n"
+            " * \"replay --emit-c\". Build and run it as root on a freshly\n"
+            " * formatted device:\n"
+            " *\n"
+            " *   gcc -O0 -o repro %s && sudo ./repro\n"
+            " */\n",
+            first, last, source, file);
+    fputs(emit_includes, out);
+    fprintf(out, "static const char *device = ");
+    emit_str(out, device);
+    fprintf(out, ";\nstatic const char *fstype = ");
+    emit_str(out, fsys);
+    fprintf(out, ";\nstatic const char *mountpoint = ");
+    emit_str(out, basepath);
+    fprintf(out, ";\nstatic char buf[%zu];\n\n", bufsize);
+    fputs(emit_helpers, out);
+
+    /* Same as prepopulate() */
+    fprintf(out, "static void prepopulate(void)\n{\n    mount_fs();\n");
+    for (size_t i = 0; i < file_dir_count; ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", basepath, file_dir_array[i]);
+        fprintf(out, "    puts(\"pre=%zu \");\n", i);
+        fprintf(out, "    puts(");
+        snprintf(call, sizeof(call), "pre_path_name=%s", path);
+        emit_str(out, call);
+        fprintf(out, ");\n");
+        emit_prepopulate(out, path);
+    }
+    fprintf(out, "    unmount_fs();\n}\n");
+
+    /* Same as replay_one(), kept out of line so that they stay apart */
+    memset(&emit_policy, 0, sizeof(emit_policy));
+    emit_policy.group = OP_MAX;
+    for (size_t n = first; n <= last; ++n) {
+        const struct replay_op *op = &ops[n];
+        if ((n - first) % EMIT_CHUNK == 0)
+            fprintf(out, "%s\nstatic void __attribute__((noinline)) ops_%zu(void)\n{\n",
+                    n == first ? "" : "}\n", (n - first) / EMIT_CHUNK);
+        if (op->opcode == OP_MAX) {
+            fprintf(out, "    /* seq=%zu: unrecognized op */\n", n);
+            continue;
+        }
+        emit_pre_op(out, op->opcode);
+        format_op(call, sizeof(call), op);
+        fprintf(out, "    seq(%zu);\n    report(", n);
+        emit_str(out, call);
+        fprintf(out, ", ");
+        emit_call(out, op, n);
+        fprintf(out, ");\n");
+        emit_post_op(out);
+    }
+    fprintf(out, "}\n\nint main(void)\n{\n    prepopulate();\n");
+    for (size_t k = 0; k <= (last - first) / EMIT_CHUNK; ++k)
+        fprintf(out, "    ops_%zu();\n", k);
+    if (emit_policy.mounted)
+        fprintf(out, "    unmount_fs();\n");
+    fprintf(out, "    return 0;\n}\n");
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Cannot write %s (%s)\n", file, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * File fd cache ("replay --fd-cache N").
+ *
+ * create_file, write_file and truncate ops open a file, do one thing with
+ * it and close it again, even when consecutive ops hit the same file. With
+ * the cache, the last N files opened stay open, keyed by interned path and
+ * open flags, and the least recently used one is closed to make room.
+ *
+ * truncate only uses a cached fd that is already open for writing, and
+ * otherwise truncates by path, so that it fails the same way as without
+ * the cache.
+ *
+ * Opening an existing file again only has no side effects without O_EXCL
+ * and O_TRUNC, so opens with either of them always go to the kernel.
+ * O_CREAT is ignored in the key: it does nothing once the file exists,
+ * and a cached fd means it does. A cached fd keeps referring to its inode
+ * even once the path stops doing so, so all of them are closed whenever a
+ * name is removed (unlink, rmdir) and before every unmount, where they
+ * would keep the file system busy.
+ */
+#include "replay.h"
+
+struct fd_entry {
+    int path_id;
+    int flags;
+    int fd;                 /* -1 if the entry is free */
+    uint64_t used;          /* LRU clock of the last use */
+};
+
+static struct fd_entry *cache;
+static int cache_size;
+static uint64_t lru_clock;
+
+static struct {
+    uint64_t hits;
+    uint64_t misses;
+} fd_stats;
+
+int fd_cache_init(int size)
+{
+    fd_cache_exit();
+    if (size <= 0)
+        return 0;
+    cache = malloc(size * sizeof(*cache));
+    if (!cache) {
+        fprintf(stderr, "Cannot allocate the fd cache (%s)\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < size; ++i)
+        cache[i].fd = -1;
+    cache_size = size;
+    return 0;
+}
+
+bool fd_cache_enabled()
+{
+    return cache_size > 0;
+}
+
+/*
+ * Open the file @id with @flags and @mode, from the cache if possible.
+ * The fd must be given back with fd_close().
+ */
+int fd_open(int id, int flags, mode_t mode)
+{
+    int key = flags & ~O_CREAT;
+    struct fd_entry *victim = NULL;
+
+    if (cache_size > 0 && !(flags & (O_EXCL | O_TRUNC))) {
+        for (int i = 0; i < cache_size; ++i) {
+            struct fd_entry *ent = &cache[i];
+            if (ent->fd >= 0 && ent->path_id == id && ent->flags == key) {
+                ent->used = ++lru_clock;
+                fd_stats.hits++;
+                return ent->fd;
+            }
+            if (!victim || ent->fd < 0 || (victim->fd >= 0 && ent->used < victim->used))
+                victim = ent;
+        }
+        fd_stats.misses++;
+    }
+
+    int dirfd;
+    const char *name;
+    path_at(id, &dirfd, &name);
+    int fd = openat(dirfd, name, flags, mode);
+    if (fd < 0 || !victim)
+        return fd;
+
+    if (victim->fd >= 0)
+        close(victim->fd);
+    victim->path_id = id;
+    victim->flags = key;
+    victim->fd = fd;
+    victim->used = ++lru_clock;
+    return fd;
+}
+
+/*
+ * A cached fd of the file @id that is open for writing, or -1. Nothing is
+ * opened: an open can fail where a path-based call would not, or with
+ * another errno.
+ */
+int fd_writable(int id)
+{
+    for (int i = 0; i < cache_size; ++i) {
+        struct fd_entry *ent = &cache[i];
+        if (ent->fd >= 0 && ent->path_id == id && (ent->flags & O_ACCMODE) != O_RDONLY) {
+            ent->used = ++lru_clock;
+            fd_stats.hits++;
+            return ent->fd;
+        }
+    }
+    return -1;
+}
+
+/* Close @fd unless it is cached */
+void fd_close(int fd)
+{
+    for (int i = 0; i < cache_size; ++i) {
+        if (cache[i].fd == fd)
+            return;
+    }
+    close(fd);
+}
+
+void fd_invalidate_all()
+{
+    for (int i = 0; i < cache_size; ++i) {
+        if (cache[i].fd >= 0) {
+            close(cache[i].fd);
+            cache[i].fd = -1;
+        }
+    }
+}
+
+/* Hit and miss counts since the last call */
+void print_fd_cache_stats()
+{
+    if (cache_size == 0)
+        return;
+    printf("fd cache: %lu hits, %lu misses\n", (unsigned long)fd_stats.hits,
+           (unsigned long)fd_stats.misses);
+    memset(&fd_stats, 0, sizeof(fd_stats));
+}
+
+void fd_cache_exit()
+{
+    fd_invalidate_all();
+    free(cache);
+    cache = NULL;
+    cache_size = 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Write data generation.
+ *
+ * Every thread owns a page-aligned write arena sized to the largest write
+ * of the sequence, so writes neither allocate nor fault in fresh pages.
+ * generate_data() fills it in one of the fill_type modes. ONES and
+ * BYTE_REPEAT are memsets (glibc already picks a vector memset for the
+ * CPU); PATTERN and RANDOM_EACH_BYTE have SSE2 and AVX2 versions chosen
+ * at runtime, with a scalar fallback elsewhere. RANDOM_EACH_BYTE draws
+ * from a per-thread xorshift128+ generator with four lanes, so every
+ * implementation produces the same bytes for the same thread.
+ */
+#include "replay.h"
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define FILL_X86
+#endif
+
+#define ARENA_ALIGN     4096
+#define RNG_LANES       4
+#define RNG_BLOCK       (RNG_LANES * sizeof(uint64_t))
+
+/* Largest write of the sequence; every arena is at least this big */
+static size_t arena_size;
+
+static __thread char *arena;
+static __thread size_t arena_cap;
+
+/* xorshift128+ state, lane i is (rng_s0[i], rng_s1[i]) */
+static __thread uint64_t rng_s0[RNG_LANES] __attribute__((aligned(32)));
+static __thread uint64_t rng_s1[RNG_LANES] __attribute__((aligned(32)));
+static __thread bool rng_seeded;
+static uint64_t rng_next_seed = 0x5eed;
+
+void write_arena_reserve(size_t len)
+{
+    if (len > arena_size)
+        arena_size = len;
+}
+
+char *write_arena(size_t len)
+{
+    if (len > arena_cap || !arena) {
+        size_t cap = max(max(len, arena_size), (size_t)1);
+        void *p;
+
+        cap = (cap + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+        free(arena);
+        if (posix_memalign(&p, ARENA_ALIGN, cap) != 0) {
+            fprintf(stderr, "Cannot allocate a %zu-byte write arena\n", cap);
+            exit(1);
+        }
+        /* Fault it in now rather than on the first write */
+        memset(p, 0, cap);
+        arena = p;
+        arena_cap = cap;
+    }
+    return arena;
+}
+
+void write_arena_release()
+{
+    free(arena);
+    arena = NULL;
+    arena_cap = 0;
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Seed each thread differently but deterministically in creation order */
+static void rng_seed()
+{
+    uint64_t x = __atomic_fetch_add(&rng_next_seed, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < RNG_LANES; ++i) {
+        rng_s0[i] = splitmix64(&x);
+        rng_s1[i] = splitmix64(&x);
+    }
+    rng_seeded = true;
+}
+
+/* One step of all the lanes into RNG_BLOCK bytes at @out */
+static inline void rng_block_scalar(char *out)
+{
+    for (int i = 0; i < RNG_LANES; ++i) {
+        uint64_t s1 = rng_s0[i];
+        const uint64_t s0 = rng_s1[i];
+        uint64_t r = s0 + s1;
+
+        rng_s0[i] = s0;
+        s1 ^= s1 << 23;
+        rng_s1[i] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+        memcpy(out + i * sizeof(uint64_t), &r, sizeof(r));
+    }
+}
+
+/* 32-bit words counting up from @base, the first one at @out */
+static inline void pattern_scalar(char *out, size_t nwords, uint32_t base)
+{
+    for (size_t i = 0; i < nwords; ++i) {
+        uint32_t v = base + i;
+        memcpy(out + i * sizeof(v), &v, sizeof(v));
+    }
+}
+
+static void random_scalar(char *buffer, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + RNG_BLOCK <= len; i += RNG_BLOCK)
+        rng_block_scalar(buffer + i);
+    if (i < len) {
+        char tail[RNG_BLOCK];
+        rng_block_scalar(tail);
+        memcpy(buffer + i, tail, len - i);
+    }
+}
+
+#ifdef FILL_X86
+static void random_sse2(char *buffer, size_t len)
+{
+    __m128i a0 = _mm_load_si128((__m128i *)&rng_s0[0]);
+    __m128i a1 = _mm_load_si128((__m128i *)&rng_s0[2]);
+    __m128i b0 = _mm_load_si128((__m128i *)&rng_s1[0]);
+    __m128i b1 = _mm_load_si128((__m128i *)&rng_s1[2]);
+    size_t i = 0;
+
+#define XS_STEP(s1, s0, out) do {                                       \
+        __m128i _t = (s1), _u = (s0);                                   \
+        out = _mm_add_epi64(_u, _t);                                    \
+        (s1) = _u;                                                      \
+        _t = _mm_xor_si128(_t, _mm_slli_epi64(_t, 23));                 \
+        (s0) = _mm_xor_si128(_mm_xor_si128(_t, _u),                     \
+                             _mm_xor_si128(_mm_srli_epi64(_t, 17),      \
+                                           _mm_srli_epi64(_u, 26)));    \
+    } while (0)
+
+    for (; i + RNG_BLOCK <= len; i += RNG_BLOCK) {
+        __m128i r0, r1;
+        XS_STEP(a0, b0, r0);
+        XS_STEP(a1, b1, r1);
+        _mm_storeu_si128((__m128i *)(buffer + i), r0);
+        _mm_storeu_si128((__m128i *)(buffer + i + 16), r1);
+    }
+#undef XS_STEP
+    _mm_store_si128((__m128i *)&rng_s0[0], a0);
+    _mm_store_si128((__m128i *)&rng_s0[2], a1);
+    _mm_store_si128((__m128i *)&rng_s1[0], b0);
+    _mm_store_si128((__m128i *)&rng_s1[2], b1);
+    random_scalar(buffer + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void random_avx2(char *buffer, size_t len)
+{
+    __m256i a = _mm256_load_si256((__m256i *)rng_s0);
+    __m256i b = _mm256_load_si256((__m256i *)rng_s1);
+    size_t i = 0;
+
+    for (; i + RNG_BLOCK <= len; i += RNG_BLOCK) {
+        __m256i t = a, u = b;
+        _mm256_storeu_si256((__m256i *)(buffer + i), _mm256_add_epi64(u, t));
+        a = u;
+        t = _mm256_xor_si256(t, _mm256_slli_epi64(t, 23));
+        b = _mm256_xor_si256(_mm256_xor_si256(t, u),
+                             _mm256_xor_si256(_mm256_srli_epi64(t, 17),
+                                              _mm256_srli_epi64(u, 26)));
+    }
+    _mm256_store_si256((__m256i *)rng_s0, a);
+    _mm256_store_si256((__m256i *)rng_s1, b);
+    random_scalar(buffer + i, len - i);
+}
+
+static void pattern_sse2(char *out, size_t nwords, uint32_t base)
+{
+    __m128i v = _mm_add_epi32(_mm_set1_epi32(base), _mm_setr_epi32(0, 1, 2, 3));
+    const __m128i step = _mm_set1_epi32(4);
+    size_t i = 0;
+
+    for (; i + 4 <= nwords; i += 4) {
+        _mm_storeu_si128((__m128i *)(out + i * 4), v);
+        v = _mm_add_epi32(v, step);
+    }
+    pattern_scalar(out + i * 4, nwords - i, base + i);
+}
+
+__attribute__((target("avx2")))
+static void pattern_avx2(char *out, size_t nwords, uint32_t base)
+{
+    __m256i v = _mm256_add_epi32(_mm256_set1_epi32(base),
+                                 _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256i step = _mm256_set1_epi32(8);
+    size_t i = 0;
+
+    for (; i + 8 <= nwords; i += 8) {
+        _mm256_storeu_si256((__m256i *)(out + i * 4), v);
+        v = _mm256_add_epi32(v, step);
+    }
+    pattern_scalar(out + i * 4, nwords - i, base + i);
+}
+#endif
+
+static void (*random_fill)(char *, size_t);
+static void (*pattern_fill)(char *, size_t, uint32_t);
+
+static void fill_select()
+{
+    random_fill = random_scalar;
+    pattern_fill = pattern_scalar;
+#ifdef FILL_X86
+    random_fill = random_sse2;
+    pattern_fill = pattern_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        random_fill = random_avx2;
+        pattern_fill = pattern_avx2;
+    }
+#endif
+}
+
+/* Generate data into a given buffer.
+ * @value: 0-255 for uniform characters */
+void generate_data(char *buffer, size_t len, size_t offset, enum fill_type type, int value)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    switch (type) {
+    /* ONES: write all byte 1 */
+    case ONES:
+        memset(buffer, 1, len);
+        break;
+    /* BYTE_REPEAT: select a random byte but write this byte uniformly */
+    case BYTE_REPEAT:
+        memset(buffer, value, len);
+        break;
+    /* PATTERN: write the bytes that are the same as the value of offsets */
+    case PATTERN:
+    {
+        size_t lead = min(3 - offset % sizeof(uint32_t), len);
+        size_t nwords = (len - lead) / sizeof(uint32_t);
+        size_t done = lead + nwords * sizeof(uint32_t);
+        uint32_t base = offset / sizeof(uint32_t);
+
+        pthread_once(&once, fill_select);
+        memset(buffer, 0, lead);
+        pattern_fill(buffer + lead, nwords, base);
+        if (done < len) {
+            uint32_t last = base + nwords;
+            memcpy(buffer + done, &last, len - done);
+        }
+        break;
+    }
+    /* RANDOM_EACH_BYTE: write random value for each int size (4 bytes) */
+    case RANDOM_EACH_BYTE:
+        pthread_once(&once, fill_select);
+        if (!rng_seeded)
+            rng_seed();
+        random_fill(buffer, len);
+        break;
+    }
+}
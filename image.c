@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Golden image restore ("replay --golden FILE").
+ *
+ * The first run captures the freshly formatted and pre-populated device
+ * into FILE. Before every iteration the device is reset to that image, so
+ * that each iteration starts from the same state instead of whatever the
+ * previous one left behind. Ram disks are rewritten with large writes
+ * from an in-memory copy of the image; for loop devices the image is
+ * cloned (FICLONE) or copied (copy_file_range) into the backing file.
+ */
+#include "replay.h"
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#ifndef FICLONE
+#define FICLONE     _IOW(0x94, 9, int)
+#endif
+
+/* Write size used when restoring onto a block device */
+#define RESTORE_CHUNK   (1 << 20)
+
+static struct {
+    const char *image;
+    const char *dev;
+    void *map;              /* the image, for block device restores */
+    size_t size;
+    int imgfd;
+    int devfd;
+    char backing[PATH_MAX]; /* backing file of a loop device, or "" */
+} golden = {.imgfd = -1, .devfd = -1};
+
+/* Find the file backing @devfd if it is a loop device */
+static void find_backing_file(int devfd)
+{
+    struct stat st;
+    char sysfs[PATH_MAX];
+
+    golden.backing[0] = '\0';
+    if (fstat(devfd, &st) != 0 || !S_ISBLK(st.st_mode))
+        return;
+    snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/loop/backing_file",
+             major(st.st_rdev), minor(st.st_rdev));
+    FILE *fp = fopen(sysfs, "r");
+    if (!fp)
+        return;
+    if (fgets(golden.backing, sizeof(golden.backing), fp)) {
+        size_t len = strlen(golden.backing);
+        if (len > 0 && golden.backing[len - 1] == '\n')
+            golden.backing[len - 1] = '\0';
+    }
+    fclose(fp);
+}
+
+/* Copy the (unmounted) device into a new image file */
+static int golden_capture()
+{
+    char *buf = malloc(RESTORE_CHUNK);
+    int ret = -1;
+
+    assert(buf);
+    int fd = open(golden.image, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s (%s)\n", golden.image, strerror(errno));
+        free(buf);
+        return -1;
+    }
+    for (size_t off = 0; off < golden.size; ) {
+        ssize_t n = pread(golden.devfd, buf, min(RESTORE_CHUNK, golden.size - off), off);
+        if (n <= 0) {
+            fprintf(stderr, "Cannot read %s (%s)\n", golden.dev,
+                    n < 0 ? strerror(errno) : "short read");
+            goto out;
+        }
+        if (write(fd, buf, n) != n) {
+            fprintf(stderr, "Cannot write %s (%s)\n", golden.image, strerror(errno));
+            goto out;
+        }
+        off += n;
+    }
+    if (fsync(fd) != 0) {
+        fprintf(stderr, "Cannot write %s (%s)\n", golden.image, strerror(errno));
+        goto out;
+    }
+    printf("Captured golden image of %s (%zu bytes) into %s\n",
+           golden.dev, golden.size, golden.image);
+    ret = 0;
+out:
+    close(fd);
+    if (ret != 0)
+        unlink(golden.image);
+    free(buf);
+    return ret;
+}
+
+/*
+ * Prepare restores of @dev from @image, capturing the image first if it
+ * does not exist yet. The device must not be mounted.
+ */
+int golden_init(const char *image, const char *dev)
+{
+    golden.image = image;
+    golden.dev = dev;
+    golden.devfd = open(dev, O_RDWR | O_CLOEXEC);
+    if (golden.devfd < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", dev, strerror(errno));
+        return -1;
+    }
+    ssize_t devsz = fsize(golden.devfd);
+    if (devsz <= 0) {
+        fprintf(stderr, "Cannot get the size of %s\n", dev);
+        goto err;
+    }
+    golden.size = devsz;
+
+    if (access(image, F_OK) != 0 && golden_capture() != 0)
+        goto err;
+
+    golden.imgfd = open(image, O_RDONLY | O_CLOEXEC);
+    if (golden.imgfd < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", image, strerror(errno));
+        goto err;
+    }
+    if (fsize(golden.imgfd) != devsz) {
+        fprintf(stderr, "Golden image %s does not match the size of %s\n",
+                image, dev);
+        goto err;
+    }
+
+    find_backing_file(golden.devfd);
+    if (golden.backing[0] == '\0') {
+        golden.map = mmap(NULL, golden.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                          golden.imgfd, 0);
+        if (golden.map == MAP_FAILED) {
+            fprintf(stderr, "Cannot mmap %s (%s)\n", image, strerror(errno));
+            golden.map = NULL;
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    golden_exit();
+    return -1;
+}
+
+/* Clone or copy the image into the backing file of a loop device */
+static int restore_backing_file()
+{
+    int fd = open(golden.backing, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", golden.backing, strerror(errno));
+        return -1;
+    }
+    if (ioctl(fd, FICLONE, golden.imgfd) != 0) {
+        loff_t in = 0, out = 0;
+        while (in < golden.size) {
+            ssize_t n = copy_file_range(golden.imgfd, &in, fd, &out,
+                                        golden.size - in, 0);
+            if (n <= 0) {
+                fprintf(stderr, "Cannot copy %s to %s (%s)\n", golden.image,
+                        golden.backing, n < 0 ? strerror(errno) : "short copy");
+                close(fd);
+                return -1;
+            }
+        }
+        fsync(fd);
+    }
+    close(fd);
+    /* Drop what the loop device cached from the old contents */
+    if (ioctl(golden.devfd, BLKFLSBUF, 0) != 0) {
+        fprintf(stderr, "Cannot flush %s (%s)\n", golden.dev, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int restore_block_device()
+{
+    for (size_t off = 0; off < golden.size; ) {
+        ssize_t n = pwrite(golden.devfd, (char *)golden.map + off,
+                           min(RESTORE_CHUNK, golden.size - off), off);
+        if (n <= 0) {
+            fprintf(stderr, "Cannot write %s (%s)\n", golden.dev,
+                    n < 0 ? strerror(errno) : "short write");
+            return -1;
+        }
+        off += n;
+    }
+    if (fsync(golden.devfd) != 0) {
+        fprintf(stderr, "Cannot write %s (%s)\n", golden.dev, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Reset the (unmounted) device to the golden image */
+int golden_restore()
+{
+    uint64_t start = now_ns();
+    int ret = golden.backing[0] ? restore_backing_file() : restore_block_device();
+    if (ret == 0)
+        printf("Restored %s from %s in %.3f ms\n", golden.dev, golden.image,
+               (now_ns() - start) / 1e6);
+    return ret;
+}
+
+void golden_exit()
+{
+    if (golden.map)
+        munmap(golden.map, golden.size);
+    if (golden.imgfd >= 0)
+        close(golden.imgfd);
+    if (golden.devfd >= 0)
+        close(golden.devfd);
+    golden.map = NULL;
+    golden.imgfd = golden.devfd = -1;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * In-kernel backend ("replay --backend kernel").
+ *
+ * Hands the compiled op stream to the metis_replay module (see kmod/),
+ * whose kthreads execute the ops through the VFS without a syscall per
+ * op. The whole sequence runs under one mount, and the results of the ops
+ * come back at the end of it, to be counted and printed like those of the
+ * other backends.
+ */
+#include "replay.h"
+#include "kmod/metis_replay.h"
+
+static int kernel_fd = -1;
+static struct mreplay_result *results;
+
+int kernel_init(const struct oplog *log)
+{
+    kernel_fd = open(MREPLAY_DEVICE, O_RDWR | O_CLOEXEC);
+    if (kernel_fd < 0) {
+        fprintf(stderr, "Cannot open %s (%s), is metis_replay.ko loaded?\n",
+                MREPLAY_DEVICE, strerror(errno));
+        return -1;
+    }
+    struct mreplay_load load = {
+        .addr = (uintptr_t)log->map,
+        .size = log->mapsize,
+    };
+    if (ioctl(kernel_fd, MREPLAY_IOC_LOAD, &load) != 0) {
+        fprintf(stderr, "Cannot load the op stream into the kernel (%s)\n",
+                strerror(errno));
+        kernel_exit();
+        return -1;
+    }
+    results = calloc(log->nrecords ? log->nrecords : 1, sizeof(*results));
+    assert(results);
+    return 0;
+}
+
+/* Replay the whole sequence in the kernel with @nthreads kthreads */
+void kernel_replay(const struct oplog *log, int nthreads)
+{
+    struct mreplay_run run = {
+        .nthreads = nthreads > 0 ? nthreads : 1,
+        .n_fs = n_fs,
+        .results = (uintptr_t)results,
+        .nresults = log->nrecords,
+    };
+
+    if (ioctl(kernel_fd, MREPLAY_IOC_RUN, &run) != 0) {
+        fprintf(stderr, "Kernel replay failed (%s)\n", strerror(errno));
+        exit(1);
+    }
+    for (uint64_t n = 0; n < log->nrecords; ++n) {
+        const struct mreplay_result *res = &results[n];
+        struct replay_op op;
+
+        if (!res->done)
+            continue;
+        oplog_get(log, n, &op);
+        struct op_stats *st = &op_stats[op.opcode];
+        st->ns += res->ns;
+        hist_record(&op_latency[op.opcode], res->ns);
+        st->count++;
+        if (res->ret < 0)
+            st->failed++;
+
+        if (tracing) {
+            trace_op(n, op.opcode, res->ret, res->err, res->ns);
+        } else {
+            printf("seq=%lu \n", (unsigned long)n);
+            report_op(&op, res->ret, res->err);
+        }
+        if (verifying)
+            model_check(&op, n, res->ret, res->err);
+    }
+}
+
+void kernel_exit()
+{
+    if (kernel_fd >= 0)
+        close(kernel_fd);
+    kernel_fd = -1;
+    free(results);
+    results = NULL;
+}
@@ -0,0 +1,622 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ */
+
+/*
+ * In-kernel replay of compiled op streams ("replay --backend kernel").
+ *
+ * The replayer hands the module a compiled op stream through
+ * /dev/metis-replay. Each run replays it with a pool of kthreads that
+ * resolve paths with kern_path() and friends and execute the ops with
+ * the vfs_*() helpers, so there is no syscall entry or exit per op and
+ * the replay runs under kernel scheduling, next to the file system's own
+ * threads (e.g. jfsCommit). Ops are sharded between the kthreads by path
+ * like "replay --threads --shard path": with one kthread they run exactly
+ * in log order.
+ *
+ * The ops behave like their user space versions in replay.c, and their
+ * results are returned in the same form (-1 and an errno) so that the
+ * replayer prints the same output. Paths are resolved from the root of
+ * the kthreads, i.e. of the initial mount namespace.
+ */
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/fs_struct.h>
+#include <linux/file.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/xattr.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/overflow.h>
+#include <linux/cred.h>
+#include <linux/ktime.h>
+#include "metis_replay.h"
+
+/* Compiled op stream format, must match the definitions in ../replay.h */
+#define OPLOG_MAGIC		"MRPLOPS"
+#define OPLOG_VERSION		1
+#define OPLOG_NOSTR		0xffff
+
+struct oplog_header {
+	char magic[8];
+	u32 version;
+	u32 record_size;
+	u64 nrecords;
+	u64 records_off;
+	u32 nstrings;
+	u32 strtab_size;
+	u64 strtab_off;
+};
+
+struct op_record {
+	u8 opcode;
+	u8 reserved;
+	u16 path;
+	u16 path2;
+	u16 value;
+	s32 flags;
+	u32 mode;
+	s64 offset;
+	u64 length;
+};
+
+enum op_code {
+	OP_CREATE_FILE,
+	OP_WRITE_FILE,
+	OP_TRUNCATE,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_SYMLINK,
+	OP_LINK,
+	OP_UNLINK,
+	OP_CHMOD,
+	OP_CHGRP,
+	OP_CHOWN,
+	OP_REMOVEXATTR,
+	OP_SETXATTR,
+	OP_MAX,
+};
+
+/* Largest stream accepted by MREPLAY_IOC_LOAD */
+#define MREPLAY_MAX_STREAM	(1ULL << 30)
+#define MREPLAY_MAX_THREADS	256
+
+/* The loaded stream, protected by mreplay_lock */
+static struct {
+	void *data;
+	const struct op_record *records;
+	u64 nrecords;
+	const char **strings;
+	u32 nstrings;
+	size_t max_write;
+} stream;
+
+static DEFINE_MUTEX(mreplay_lock);
+
+struct mreplay_worker {
+	struct task_struct *task;
+	struct completion done;
+	unsigned int id;
+	unsigned int nthreads;
+	unsigned int n_fs;
+	void *buffer;			/* write_file data */
+	struct mreplay_result *results;
+	bool *stop;
+};
+
+static void mreplay_unload(void)
+{
+	kvfree(stream.strings);
+	kvfree(stream.data);
+	memset(&stream, 0, sizeof(stream));
+}
+
+/* Check @data like oplog_open() does and index its strings */
+static int mreplay_parse(void *data, size_t size)
+{
+	const struct oplog_header *hdr = data;
+	const u32 *offsets;
+	const char *blob;
+	u64 end;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, OPLOG_MAGIC, sizeof(OPLOG_MAGIC)) != 0 ||
+	    hdr->version != OPLOG_VERSION ||
+	    hdr->record_size != sizeof(struct op_record))
+		return -EINVAL;
+	if (hdr->records_off % sizeof(u64) != 0 || hdr->records_off > size ||
+	    hdr->nrecords > (size - hdr->records_off) / sizeof(struct op_record))
+		return -EINVAL;
+	if (hdr->strtab_off % sizeof(u32) != 0 || hdr->strtab_off > size ||
+	    check_add_overflow((u64)hdr->nstrings * sizeof(u32),
+			       (u64)hdr->strtab_size, &end) ||
+	    end > size - hdr->strtab_off)
+		return -EINVAL;
+
+	offsets = data + hdr->strtab_off;
+	blob = (const char *)(offsets + hdr->nstrings);
+	stream.strings = kvmalloc_array(max_t(u32, hdr->nstrings, 1),
+					sizeof(char *), GFP_KERNEL);
+	if (!stream.strings)
+		return -ENOMEM;
+	for (u32 i = 0; i < hdr->nstrings; ++i) {
+		if (offsets[i] >= hdr->strtab_size ||
+		    !memchr(blob + offsets[i], '\0', hdr->strtab_size - offsets[i]))
+			return -EINVAL;
+		stream.strings[i] = blob + offsets[i];
+	}
+	stream.nstrings = hdr->nstrings;
+
+	stream.records = data + hdr->records_off;
+	stream.nrecords = hdr->nrecords;
+	stream.max_write = 1;
+	for (u64 i = 0; i < stream.nrecords; ++i) {
+		const struct op_record *rec = &stream.records[i];
+
+		if (rec->opcode >= OP_MAX || rec->path >= stream.nstrings ||
+		    (rec->path2 != OPLOG_NOSTR && rec->path2 >= stream.nstrings) ||
+		    (rec->value != OPLOG_NOSTR && rec->value >= stream.nstrings))
+			return -EINVAL;
+		if ((rec->opcode == OP_SYMLINK || rec->opcode == OP_LINK ||
+		     rec->opcode == OP_SETXATTR || rec->opcode == OP_REMOVEXATTR) &&
+		    rec->path2 == OPLOG_NOSTR)
+			return -EINVAL;
+		if (rec->opcode == OP_SETXATTR && rec->value == OPLOG_NOSTR)
+			return -EINVAL;
+		if (rec->opcode == OP_WRITE_FILE) {
+			if (rec->length > MAX_RW_COUNT)
+				return -EINVAL;
+			stream.max_write = max_t(size_t, stream.max_write, rec->length);
+		}
+	}
+	return 0;
+}
+
+static int mreplay_load(struct mreplay_load __user *uarg)
+{
+	struct mreplay_load load;
+	void *data;
+	int ret;
+
+	if (copy_from_user(&load, uarg, sizeof(load)))
+		return -EFAULT;
+	if (load.size == 0 || load.size > MREPLAY_MAX_STREAM)
+		return -EINVAL;
+	data = vmemdup_user(u64_to_user_ptr(load.addr), load.size);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	mreplay_unload();
+	stream.data = data;
+	ret = mreplay_parse(data, load.size);
+	if (ret)
+		mreplay_unload();
+	return ret;
+}
+
+static int mreplay_create_file(const char *name, int flags, umode_t mode)
+{
+	struct file *file = filp_open(name, flags, mode);
+
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	filp_close(file, NULL);
+	return 0;
+}
+
+static ssize_t mreplay_write_file(const char *name, int flags, void *data,
+				  loff_t pos, size_t length)
+{
+	/* Same (odd) mode argument as write_file() */
+	struct file *file = filp_open(name, flags, O_RDWR);
+	ssize_t ret;
+
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	ret = kernel_write(file, data, length, &pos);
+	filp_close(file, NULL);
+	return ret;
+}
+
+static int mreplay_truncate(const char *name, loff_t length)
+{
+	struct path path;
+	int ret = kern_path(name, LOOKUP_FOLLOW, &path);
+
+	if (ret)
+		return ret;
+	ret = vfs_truncate(&path, length);
+	path_put(&path);
+	return ret;
+}
+
+static int mreplay_mkdir(const char *name, umode_t mode)
+{
+	struct path path;
+	struct dentry *dentry;
+	int ret;
+
+	dentry = kern_path_create(AT_FDCWD, name, &path, LOOKUP_DIRECTORY);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	if (!IS_POSIXACL(path.dentry->d_inode))
+		mode &= ~current_umask();
+	ret = vfs_mkdir(mnt_idmap(path.mnt), d_inode(path.dentry), dentry, mode);
+	done_path_create(&path, dentry);
+	return ret;
+}
+
+static int mreplay_symlink(const char *target, const char *name)
+{
+	struct path path;
+	struct dentry *dentry;
+	int ret;
+
+	dentry = kern_path_create(AT_FDCWD, name, &path, 0);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	ret = vfs_symlink(mnt_idmap(path.mnt), d_inode(path.dentry), dentry, target);
+	done_path_create(&path, dentry);
+	return ret;
+}
+
+static int mreplay_link(const char *oldname, const char *newname)
+{
+	struct path old_path, new_path;
+	struct dentry *dentry;
+	int ret;
+
+	ret = kern_path(oldname, 0, &old_path);
+	if (ret)
+		return ret;
+	dentry = kern_path_create(AT_FDCWD, newname, &new_path, 0);
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+		goto out;
+	}
+	if (old_path.mnt != new_path.mnt)
+		ret = -EXDEV;
+	else
+		ret = vfs_link(old_path.dentry, mnt_idmap(new_path.mnt),
+			       d_inode(new_path.dentry), dentry, NULL);
+	done_path_create(&new_path, dentry);
+out:
+	path_put(&old_path);
+	return ret;
+}
+
+/* unlink or rmdir @name, looking up its last component under the parent */
+static int mreplay_remove(const char *name, bool dir)
+{
+	const char *last = strrchr(name, '/');
+	struct path parent;
+	struct dentry *dentry;
+	struct inode *inode;
+	char *parent_name;
+	int ret;
+
+	if (!last || !last[1])
+		return -EINVAL;
+	parent_name = kstrndup(name, last == name ? 1 : last - name, GFP_KERNEL);
+	if (!parent_name)
+		return -ENOMEM;
+	ret = kern_path(parent_name, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &parent);
+	kfree(parent_name);
+	if (ret)
+		return ret;
+	last++;
+
+	ret = mnt_want_write(parent.mnt);
+	if (ret)
+		goto out;
+	inode = d_inode(parent.dentry);
+	inode_lock_nested(inode, I_MUTEX_PARENT);
+	dentry = lookup_one_len(last, parent.dentry, strlen(last));
+	if (IS_ERR(dentry)) {
+		ret = PTR_ERR(dentry);
+	} else {
+		if (d_is_negative(dentry))
+			ret = -ENOENT;
+		else if (dir)
+			ret = vfs_rmdir(mnt_idmap(parent.mnt), inode, dentry);
+		else
+			ret = vfs_unlink(mnt_idmap(parent.mnt), inode, dentry, NULL);
+		dput(dentry);
+	}
+	inode_unlock(inode);
+	mnt_drop_write(parent.mnt);
+out:
+	path_put(&parent);
+	return ret;
+}
+
+/* chmod, chown and chgrp, following symlinks like the syscalls */
+static int mreplay_setattr(const char *name, u8 opcode, u32 value)
+{
+	kuid_t uid = make_kuid(current_user_ns(), value);
+	kgid_t gid = make_kgid(current_user_ns(), value);
+	struct iattr attr = {};
+	struct inode *inode;
+	struct path path;
+	int ret;
+
+	ret = kern_path(name, LOOKUP_FOLLOW, &path);
+	if (ret)
+		return ret;
+	/* -1 leaves the owner unchanged, like in chown_common() */
+	if (value != (u32)-1 && ((opcode == OP_CHOWN && !uid_valid(uid)) ||
+				 (opcode == OP_CHGRP && !gid_valid(gid)))) {
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = mnt_want_write(path.mnt);
+	if (ret)
+		goto out;
+	inode = d_inode(path.dentry);
+	inode_lock(inode);
+	attr.ia_valid = ATTR_CTIME;
+	switch (opcode) {
+	case OP_CHMOD:
+		attr.ia_valid |= ATTR_MODE;
+		attr.ia_mode = (value & S_IALLUGO) | (inode->i_mode & ~S_IALLUGO);
+		break;
+	case OP_CHOWN:
+		if (value == (u32)-1)
+			break;
+		attr.ia_valid |= ATTR_UID;
+		attr.ia_vfsuid = VFSUIDT_INIT(uid);
+		break;
+	case OP_CHGRP:
+		if (value == (u32)-1)
+			break;
+		attr.ia_valid |= ATTR_GID;
+		attr.ia_vfsgid = VFSGIDT_INIT(gid);
+		break;
+	}
+	if (opcode != OP_CHMOD && !S_ISDIR(inode->i_mode))
+		attr.ia_valid |= ATTR_KILL_SUID | ATTR_KILL_SGID | ATTR_KILL_PRIV;
+	ret = notify_change(mnt_idmap(path.mnt), path.dentry, &attr, NULL);
+	inode_unlock(inode);
+	mnt_drop_write(path.mnt);
+out:
+	path_put(&path);
+	return ret;
+}
+
+static int mreplay_xattr(const char *name, const char *xname,
+			 const char *value, size_t size, int flags, bool remove)
+{
+	size_t vlen = strlen(value) + 1;
+	struct path path;
+	char *kvalue = NULL;
+	int ret;
+
+	if (!remove) {
+		if (size > XATTR_SIZE_MAX)
+			return -E2BIG;
+		/* The value is padded with zeros if the size goes past it */
+		kvalue = kvzalloc(max(size, vlen), GFP_KERNEL);
+		if (!kvalue)
+			return -ENOMEM;
+		memcpy(kvalue, value, vlen);
+	}
+	ret = kern_path(name, LOOKUP_FOLLOW, &path);
+	if (ret)
+		goto out;
+	ret = mnt_want_write(path.mnt);
+	if (ret == 0) {
+		if (remove)
+			ret = vfs_removexattr(mnt_idmap(path.mnt), path.dentry, xname);
+		else
+			ret = vfs_setxattr(mnt_idmap(path.mnt), path.dentry, xname,
+					   kvalue, size, flags);
+		mnt_drop_write(path.mnt);
+	}
+	path_put(&path);
+out:
+	kvfree(kvalue);
+	return ret;
+}
+
+/* Execute op @seq, returning a negative errno or the op's result */
+static long mreplay_op(struct mreplay_worker *w, u64 seq)
+{
+	const struct op_record *rec = &stream.records[seq];
+	const char *path = stream.strings[rec->path];
+	const char *path2 = rec->path2 != OPLOG_NOSTR ? stream.strings[rec->path2] : NULL;
+
+	switch (rec->opcode) {
+	case OP_CREATE_FILE:
+		return mreplay_create_file(path, rec->flags, rec->mode);
+	case OP_WRITE_FILE:
+		/* The same data as fill_write_data() */
+		memset(w->buffer, (seq / w->n_fs) & 0xff, rec->length);
+		return mreplay_write_file(path, rec->flags, w->buffer,
+					  rec->offset, rec->length);
+	case OP_TRUNCATE:
+		return mreplay_truncate(path, rec->length);
+	case OP_MKDIR:
+		return mreplay_mkdir(path, rec->mode);
+	case OP_RMDIR:
+		return mreplay_remove(path, true);
+	case OP_UNLINK:
+		return mreplay_remove(path, false);
+	case OP_SYMLINK:
+		return mreplay_symlink(path, path2);
+	case OP_LINK:
+		return mreplay_link(path, path2);
+	case OP_CHMOD:
+	case OP_CHOWN:
+	case OP_CHGRP:
+		return mreplay_setattr(path, rec->opcode, rec->mode);
+	case OP_SETXATTR:
+		return mreplay_xattr(path, path2, stream.strings[rec->value],
+				     rec->length, rec->flags, false);
+	case OP_REMOVEXATTR:
+		return mreplay_xattr(path, path2, "", 0, 0, true);
+	}
+	return -EINVAL;
+}
+
+static int mreplay_worker_main(void *arg)
+{
+	struct mreplay_worker *w = arg;
+
+	for (u64 seq = 0; seq < stream.nrecords && !READ_ONCE(*w->stop); ++seq) {
+		const struct op_record *rec = &stream.records[seq];
+		struct mreplay_result *res = &w->results[seq];
+		u64 start;
+		long ret;
+
+		if (rec->path % w->nthreads != w->id)
+			continue;
+		start = ktime_get_ns();
+		ret = mreplay_op(w, seq);
+		res->ns = ktime_get_ns() - start;
+		res->ret = ret < 0 ? -1 : ret;
+		res->err = ret < 0 ? -ret : 0;
+		res->done = 1;
+		cond_resched();
+	}
+	kthread_complete_and_exit(&w->done, 0);
+}
+
+static int mreplay_run(struct mreplay_run __user *uarg)
+{
+	struct mreplay_worker *workers;
+	struct mreplay_result *results;
+	struct mreplay_run run;
+	bool stop = false;
+	unsigned int n;
+	int ret = 0;
+
+	if (copy_from_user(&run, uarg, sizeof(run)))
+		return -EFAULT;
+	if (!stream.data)
+		return -ENODATA;
+	if (run.nresults != stream.nrecords || run.n_fs == 0 ||
+	    run.nthreads == 0 || run.nthreads > MREPLAY_MAX_THREADS)
+		return -EINVAL;
+
+	results = kvcalloc(max_t(u64, stream.nrecords, 1), sizeof(*results),
+			   GFP_KERNEL);
+	workers = kcalloc(run.nthreads, sizeof(*workers), GFP_KERNEL);
+	if (!results || !workers) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (n = 0; n < run.nthreads; ++n) {
+		struct mreplay_worker *w = &workers[n];
+
+		w->id = n;
+		w->nthreads = run.nthreads;
+		w->n_fs = run.n_fs;
+		w->results = results;
+		w->stop = &stop;
+		init_completion(&w->done);
+		w->buffer = kvmalloc(stream.max_write, GFP_KERNEL);
+		if (!w->buffer) {
+			ret = -ENOMEM;
+			break;
+		}
+		w->task = kthread_run(mreplay_worker_main, w, "mreplay/%u", n);
+		if (IS_ERR(w->task)) {
+			ret = PTR_ERR(w->task);
+			w->task = NULL;
+			break;
+		}
+	}
+	if (ret)
+		WRITE_ONCE(stop, true);
+
+	/* Stop at the next op on a fatal signal, but wait for the kthreads in
+	 * any case: they use the stream and this stack */
+	for (unsigned int i = 0; i < n; ++i) {
+		if (!workers[i].task)
+			continue;
+		if (READ_ONCE(stop)) {
+			wait_for_completion(&workers[i].done);
+		} else if (wait_for_completion_killable(&workers[i].done)) {
+			WRITE_ONCE(stop, true);
+			ret = -EINTR;
+			wait_for_completion(&workers[i].done);
+		}
+	}
+
+	if (ret == 0 && copy_to_user(u64_to_user_ptr(run.results), results,
+				     stream.nrecords * sizeof(*results)))
+		ret = -EFAULT;
+out:
+	if (workers) {
+		for (n = 0; n < run.nthreads; ++n)
+			kvfree(workers[n].buffer);
+	}
+	kfree(workers);
+	kvfree(results);
+	return ret;
+}
+
+static long mreplay_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	long ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	mutex_lock(&mreplay_lock);
+	switch (cmd) {
+	case MREPLAY_IOC_LOAD:
+		ret = mreplay_load((struct mreplay_load __user *)arg);
+		break;
+	case MREPLAY_IOC_RUN:
+		ret = mreplay_run((struct mreplay_run __user *)arg);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+	mutex_unlock(&mreplay_lock);
+	return ret;
+}
+
+static const struct file_operations mreplay_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = mreplay_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+};
+
+static struct miscdevice mreplay_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "metis-replay",
+	.fops = &mreplay_fops,
+	.mode = 0600,
+};
+
+static int __init mreplay_init(void)
+{
+	return misc_register(&mreplay_dev);
+}
+
+static void __exit mreplay_exit(void)
+{
+	misc_deregister(&mreplay_dev);
+	mreplay_unload();
+}
+
+module_init(mreplay_init);
+module_exit(mreplay_exit);
+
+MODULE_DESCRIPTION("Metis replayer: in-kernel replay of compiled op streams");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ */
+
+/*
+ * Interface of the in-kernel replay module, shared by the module and the
+ * replayer ("replay --backend kernel").
+ *
+ * The replayer loads a compiled op stream (the contents of a .ops file)
+ * with MREPLAY_IOC_LOAD, then replays it with MREPLAY_IOC_RUN once per
+ * iteration, after mounting the file system the paths of the stream
+ * point into. The run returns when all ops were executed, and fills in
+ * the result of every op.
+ */
+#ifndef _METIS_REPLAY_H
+#define _METIS_REPLAY_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MREPLAY_DEVICE      "/dev/metis-replay"
+
+struct mreplay_load {
+	__u64 addr;             /* the compiled op stream */
+	__u64 size;
+};
+
+/* Result of one op, indexed by its seq */
+struct mreplay_result {
+	__s32 ret;              /* return value like in user space, e.g. -1 */
+	__s32 err;              /* errno if ret is -1 */
+	__u64 ns;               /* time the op took */
+	__u32 done;             /* 0 if the run stopped before the op */
+	__u32 reserved;
+};
+
+struct mreplay_run {
+	__u32 nthreads;         /* kthreads, ops are sharded by path */
+	__u32 n_fs;             /* write_file data is the byte seq / n_fs */
+	__u64 results;          /* struct mreplay_result[nresults] */
+	__u64 nresults;         /* number of ops in the stream */
+};
+
+#define MREPLAY_IOC_MAGIC   'M'
+#define MREPLAY_IOC_LOAD    _IOW(MREPLAY_IOC_MAGIC, 1, struct mreplay_load)
+#define MREPLAY_IOC_RUN     _IOW(MREPLAY_IOC_MAGIC, 2, struct mreplay_run)
+
+#endif /* _METIS_REPLAY_H */
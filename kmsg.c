@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Kernel oops watcher ("replay --oops-report FILE").
+ *
+ * A thread tails /dev/kmsg while the sequence is replayed. When a line
+ * looks like the start of an oops, it writes the iteration, the last ops
+ * that were started and the kernel messages that follow to FILE, fsyncs
+ * everything, and stops the replay.
+ */
+#include "replay.h"
+#include <poll.h>
+#include <pthread.h>
+
+/* How long to keep collecting kernel messages after the first match */
+#define OOPS_COLLECT_MS     500
+#define OOPS_MAX_LINES      128
+
+static const char *oops_patterns[] = {
+    "BUG:", "Oops:", "RIP:", "general protection fault", "Kernel panic",
+};
+
+bool oops_watching;
+bool oops_detected;
+int oops_history[OOPS_HISTORY];
+unsigned int oops_next;
+
+static struct {
+    const char *report;
+    const struct replay_op *ops;
+    size_t nops;
+    int kmsg;
+    int stop[2];            /* pipe to wake the watcher up on exit */
+    pthread_t thread;
+} watch = {.kmsg = -1};
+
+static bool oops_match(const char *msg)
+{
+    for (size_t i = 0; i < sizeof(oops_patterns) / sizeof(oops_patterns[0]); ++i)
+        if (strstr(msg, oops_patterns[i]))
+            return true;
+    return false;
+}
+
+/*
+ * Read one record from /dev/kmsg and return its message text, without the
+ * "prio,seq,time,flags;" prefix, or NULL if there is none right now.
+ */
+static char *kmsg_read(char *buf, size_t size)
+{
+    for (;;) {
+        ssize_t n = read(watch.kmsg, buf, size - 1);
+        if (n < 0 && errno == EPIPE)
+            continue;       /* overwritten before we read it */
+        if (n <= 0)
+            return NULL;
+        buf[n] = '\0';
+        if (buf[n - 1] == '\n')
+            buf[n - 1] = '\0';
+        char *msg = strchr(buf, ';');
+        return msg ? msg + 1 : buf;
+    }
+}
+
+static void write_op(FILE *fp, int seq)
+{
+    if (seq < 0 || (size_t)seq >= watch.nops) {
+        fprintf(fp, "seq=%d\n", seq);
+        return;
+    }
+    const struct replay_op *op = &watch.ops[seq];
+    fprintf(fp, "seq=%d %s(%s", seq,
+            op->opcode < OP_MAX ? op_names[op->opcode] : "unknown",
+            op->path ? op->path : "");
+    if (op->path2)
+        fprintf(fp, ", %s", op->path2);
+    fprintf(fp, ")\n");
+}
+
+static void oops_report(const char *first)
+{
+    FILE *fp = fopen(watch.report, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s (%s)\n", watch.report, strerror(errno));
+        fp = stderr;
+    }
+
+    /* Snapshot the history before more ops are started */
+    unsigned int next = __atomic_load_n(&oops_next, __ATOMIC_ACQUIRE);
+    unsigned int n = min(next, OOPS_HISTORY);
+    int history[OOPS_HISTORY];
+    for (unsigned int i = 0; i < n; ++i)
+        history[i] = oops_history[(next - n + i) % OOPS_HISTORY];
+
+    fprintf(fp, "Kernel oops during iteration %lu", iteration);
+    if (n > 0)
+        fprintf(fp, " at seq=%d", history[n - 1]);
+    fprintf(fp, "\n\nLast %u ops started:\n", n);
+    for (unsigned int i = 0; i < n; ++i)
+        write_op(fp, history[i]);
+
+    fprintf(fp, "\nKernel log:\n%s\n", first);
+    fflush(fp);
+    if (fp != stderr)
+        fsync(fileno(fp));
+
+    /* The rest of the oops (registers, call trace) follows right away */
+    char buf[8192];
+    uint64_t deadline = now_ns() + OOPS_COLLECT_MS * 1000000ull;
+    struct pollfd pfd = {.fd = watch.kmsg, .events = POLLIN};
+    for (int lines = 1; lines < OOPS_MAX_LINES; ) {
+        uint64_t now = now_ns();
+        if (now >= deadline || poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0)
+            break;
+        char *msg;
+        while (lines < OOPS_MAX_LINES && (msg = kmsg_read(buf, sizeof(buf)))) {
+            fprintf(fp, "%s\n", msg);
+            lines++;
+        }
+    }
+    fflush(fp);
+    if (fp != stderr) {
+        fsync(fileno(fp));
+        fclose(fp);
+    }
+    fprintf(stderr, "Kernel oops detected, see %s\n", watch.report);
+}
+
+static void *oops_watch(void *arg)
+{
+    struct pollfd pfds[2] = {
+        {.fd = watch.kmsg, .events = POLLIN},
+        {.fd = watch.stop[0], .events = POLLIN},
+    };
+    char buf[8192];
+
+    (void)arg;
+    while (poll(pfds, 2, -1) >= 0 || errno == EINTR) {
+        if (pfds[1].revents)
+            break;
+        char *msg;
+        while ((msg = kmsg_read(buf, sizeof(buf)))) {
+            if (!oops_match(msg))
+                continue;
+            oops_report(msg);
+            /* Get whatever the replay has written so far onto the disk */
+            if (ftrylockfile(stdout) == 0) {
+                fflush(stdout);
+                funlockfile(stdout);
+            }
+            fsync(STDOUT_FILENO);
+            trace_sync();
+            __atomic_store_n(&oops_detected, true, __ATOMIC_RELEASE);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Start watching the kernel log; @ops are used to describe the history */
+int oops_watch_start(const char *report, const struct replay_op *ops, size_t nops)
+{
+    watch.report = report;
+    watch.ops = ops;
+    watch.nops = nops;
+    watch.kmsg = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (watch.kmsg < 0) {
+        fprintf(stderr, "Cannot open /dev/kmsg (%s)\n", strerror(errno));
+        return -1;
+    }
+    /* Only look at messages from now on */
+    lseek(watch.kmsg, 0, SEEK_END);
+    if (pipe(watch.stop) != 0) {
+        fprintf(stderr, "Cannot create pipe (%s)\n", strerror(errno));
+        close(watch.kmsg);
+        return -1;
+    }
+    int err = pthread_create(&watch.thread, NULL, oops_watch, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Cannot create oops watcher (%s)\n", strerror(err));
+        close(watch.stop[0]);
+        close(watch.stop[1]);
+        close(watch.kmsg);
+        return -1;
+    }
+    oops_watching = true;
+    return 0;
+}
+
+void oops_watch_stop()
+{
+    if (!oops_watching)
+        return;
+    if (write(watch.stop[1], "", 1) != 1)
+        pthread_cancel(watch.thread);
+    pthread_join(watch.thread, NULL);
+    close(watch.stop[0]);
+    close(watch.stop[1]);
+    close(watch.kmsg);
+    oops_watching = false;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Differential replay ("replay --differential jfs:/dev/ram0,ext4:/dev/ram1").
+ *
+ * The sequence is replayed on several file systems at once, one campaign
+ * instance per file system, each on its own device and mount point (e.g.
+ * /mnt/test-ext4-i0-s1). The instances run every op concurrently and then
+ * wait for each other on a barrier, so the sequence takes about as long
+ * as on the slowest file system. After every op, the first instance
+ * compares the results of all of them and reports the ops whose return
+ * value or errno differ, and with --state-hash, the ops after which the
+ * state of the file systems stops being the same.
+ */
+#include "replay.h"
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define LOCKSTEP_MAX_FS     8
+
+/* Result of one op on one file system */
+struct lockstep_result {
+    int ret;
+    int err;
+    uint64_t hash[2];
+};
+
+/* Shared by the instances */
+struct lockstep_shared {
+    pthread_barrier_t barrier;
+    char fsys[LOCKSTEP_MAX_FS][32];
+    char device[LOCKSTEP_MAX_FS][PATH_MAX];
+    char name[LOCKSTEP_MAX_FS][PATH_MAX];
+    /* Two rounds, so that the first instance can compare one op while
+     * the others run the next */
+    struct lockstep_result results[2][LOCKSTEP_MAX_FS];
+    uint64_t compared;          /* in the current iteration */
+    uint64_t divergences;
+    uint64_t total_divergences;
+};
+
+int lockstep_fs = 0;
+
+static struct lockstep_shared *shared;
+static int self = -1;
+static uint64_t rounds;
+static bool state_diverged;
+
+/* A comma-separated list of FS:DEVICE, e.g. jfs:/dev/ram0,ext4:/dev/ram1 */
+int lockstep_parse(const char *list)
+{
+    char buf[LOCKSTEP_MAX_FS * (PATH_MAX + 32)];
+    char *saveptr, *tok;
+    int n = 0;
+
+    if (strlen(list) >= sizeof(buf))
+        return -1;
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Cannot allocate lockstep state (%s)\n", strerror(errno));
+        exit(1);
+    }
+    memset(shared, 0, sizeof(*shared));
+
+    strcpy(buf, list);
+    for (tok = strtok_r(buf, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        char *colon = strchr(tok, ':');
+        if (!colon || colon == tok || colon[1] == '\0' || n == LOCKSTEP_MAX_FS ||
+            colon - tok >= (long)sizeof(shared->fsys[n]))
+            return -1;
+        snprintf(shared->fsys[n], sizeof(shared->fsys[n]), "%.*s", (int)(colon - tok), tok);
+        snprintf(shared->device[n], sizeof(shared->device[n]), "%s", colon + 1);
+        snprintf(shared->name[n], sizeof(shared->name[n]), "%s", tok);
+        n++;
+    }
+    if (n < 2)
+        return -1;
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shared->barrier, &attr, n);
+    pthread_barrierattr_destroy(&attr);
+    lockstep_fs = n;
+    return 0;
+}
+
+/* "FS:DEVICE" of instance @k, for the campaign summary */
+const char *lockstep_name(int k)
+{
+    return shared->name[k];
+}
+
+/* Switch the file system and device of this process over to instance @k */
+void lockstep_join(int k)
+{
+    self = k;
+    fsys = shared->fsys[k];
+    device = shared->device[k];
+}
+
+/* Report op @seq if its results differ between the file systems */
+static void lockstep_compare(const struct replay_op *op, int seq,
+                             const struct lockstep_result *res)
+{
+    bool diverged = false;
+
+    shared->compared++;
+    for (int k = 1; k < lockstep_fs; ++k) {
+        if (res[k].ret != res[0].ret || (res[0].ret < 0 && res[k].err != res[0].err))
+            diverged = true;
+    }
+    if (diverged) {
+        char call[3 * PATH_MAX];
+        format_op(call, sizeof(call), op);
+        flockfile(stderr);
+        fprintf(stderr, "Divergence at seq=%d: %s\n", seq, call);
+        for (int k = 0; k < lockstep_fs; ++k)
+            fprintf(stderr, "    %-8s ret=%d, errno=%s\n", shared->fsys[k],
+                    res[k].ret, strerror(res[k].err));
+        funlockfile(stderr);
+        shared->divergences++;
+        shared->total_divergences++;
+    }
+    if (!state_hashing)
+        return;
+
+    /* Only report the op after which the states stopped being equal */
+    bool equal = true;
+    for (int k = 1; k < lockstep_fs; ++k) {
+        if (res[k].hash[0] != res[0].hash[0] || res[k].hash[1] != res[0].hash[1])
+            equal = false;
+    }
+    if (!equal && !state_diverged) {
+        flockfile(stderr);
+        fprintf(stderr, "State diverged at seq=%d\n", seq);
+        for (int k = 0; k < lockstep_fs; ++k)
+            fprintf(stderr, "    %-8s %016lx%016lx\n", shared->fsys[k],
+                    (unsigned long)res[k].hash[1], (unsigned long)res[k].hash[0]);
+        funlockfile(stderr);
+        shared->divergences++;
+        shared->total_divergences++;
+    }
+    state_diverged = !equal;
+}
+
+/* Hand in the result of op @seq and wait until all file systems ran it */
+void lockstep_op(const struct replay_op *op, int seq, int ret, int err)
+{
+    struct lockstep_result *res = shared->results[rounds++ & 1];
+
+    res[self].ret = ret;
+    res[self].err = err;
+    if (state_hashing)
+        state_hash_get(res[self].hash);
+    pthread_barrier_wait(&shared->barrier);
+    if (self == 0)
+        lockstep_compare(op, seq, res);
+}
+
+/* Start over with the next iteration */
+void lockstep_reset()
+{
+    if (self == 0) {
+        shared->compared = 0;
+        shared->divergences = 0;
+        state_diverged = false;
+    }
+}
+
+uint64_t lockstep_divergences()
+{
+    return shared ? shared->total_divergences : 0;
+}
+
+void print_lockstep_stats()
+{
+    if (self == 0)
+        printf("Lockstep: %lu ops compared on %d file systems, %lu divergences\n",
+               (unsigned long)shared->compared, lockstep_fs,
+               (unsigned long)shared->divergences);
+}
@@ -17,30 +17,19 @@ command="sudo ./replay"
 # Number of execution iterations
 num_executions=500
 
+# Delay (in milliseconds) between two iterations
+delay_ms=0
+
 # Single log file for all executions
 log_file="loop_replay.log"
 
 # Start time of the entire script
 script_start_time=$(date +%s)
 
-for ((i = 0; i < num_executions; i++)); do
-    echo "Replay iteration: $((i+1))" | tee -a "$log_file"
-    
-    # Measure the time taken for each command execution
-    iteration_start_time=$(date +%s)
-
-    # Execute the command and display output only on the console
-    { time $command; } 2>&1 | grep -E '^(real|user|sys)' | tee -a "$log_file"
-    
-    iteration_end_time=$(date +%s)
-    iteration_duration=$((iteration_end_time - iteration_start_time))
-    
-    echo "Iteration $((i+1)) took $iteration_duration seconds" | tee -a "$log_file"
-
-    # sleep (duration in secs) before next execution
-    sleep 2
-
-done
+# The replayer loops over the iterations itself, loading the sequence only
+# once, and prints the real/user/sys time of every iteration
+$command --iterations "$num_executions" --inter-iteration-delay "$delay_ms" 2>&1 | \
+    grep -E '^(Replay iteration|real|user|sys|Iteration)' | tee -a "$log_file"
 
 # End time of the entire script
 script_end_time=$(date +%s)
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Sequence minimizer ("replay --minimize DIR").
+ *
+ * Delta debugging (ddmin) over the op sequence: the sequence is split into
+ * chunks, and each chunk and each complement of a chunk is replayed in a
+ * child process, from the golden image, for the given number of
+ * iterations. A candidate reproduces the crash if the oops watcher fires
+ * or if it does not finish within the test timeout. A reproducing
+ * candidate replaces the sequence; otherwise the chunks get smaller.
+ *
+ * The state is written to DIR/checkpoint before and after every test. A
+ * test that was still running when the machine went down counts as
+ * reproducing, so rerunning the same command after a reboot continues
+ * where the minimizer left off. The result is written to DIR/minimized.log
+ * in the text log format.
+ */
+#include "replay.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+/* How long to wait for a killed test to go away before giving up */
+#define REAP_TIMEOUT_MS     10000
+
+enum test_result {
+    TEST_PASSED,            /* ran to the end without an oops */
+    TEST_REPRODUCED,        /* oops, or did not finish in time */
+    TEST_ERROR,             /* the test itself failed */
+    TEST_STUCK,             /* reproduced, and the test cannot be killed */
+};
+
+struct ddmin {
+    uint32_t *kept;         /* indexes of the ops in the current sequence */
+    size_t nkept;
+    size_t granularity;     /* number of chunks */
+    size_t next;            /* next candidate of this round */
+    bool testing;           /* a test was running when the state was saved */
+};
+
+static char checkpoint[PATH_MAX];
+
+static int save_checkpoint(const struct ddmin *dd, size_t nops)
+{
+    char tmp[PATH_MAX + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "ops %zu\ngranularity %zu\nnext %zu\ntesting %d\n",
+            nops, dd->granularity, dd->next, dd->testing);
+
+    /* The kept ops as ranges of indexes */
+    size_t nranges = 0;
+    for (size_t i = 0; i < dd->nkept; ++i)
+        if (i == 0 || dd->kept[i] != dd->kept[i - 1] + 1)
+            nranges++;
+    fprintf(fp, "ranges %zu\n", nranges);
+    for (size_t i = 0; i < dd->nkept; ) {
+        size_t j = i + 1;
+        while (j < dd->nkept && dd->kept[j] == dd->kept[j - 1] + 1)
+            j++;
+        fprintf(fp, "%u %u\n", dd->kept[i], dd->kept[j - 1] + 1);
+        i = j;
+    }
+
+    int ret = 0;
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        ret = -1;
+    if (fclose(fp) != 0 || ret != 0 || rename(tmp, checkpoint) != 0) {
+        fprintf(stderr, "Cannot write %s (%s)\n", checkpoint, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns 1 if there is no checkpoint, 0 if it was loaded, -1 on error */
+static int load_checkpoint(struct ddmin *dd, size_t nops)
+{
+    FILE *fp = fopen(checkpoint, "r");
+    if (!fp)
+        return errno == ENOENT ? 1 : -1;
+
+    size_t saved_nops, nranges;
+    int testing;
+    if (fscanf(fp, "ops %zu granularity %zu next %zu testing %d ranges %zu",
+               &saved_nops, &dd->granularity, &dd->next, &testing,
+               &nranges) != 5 || saved_nops != nops) {
+        fprintf(stderr, "%s does not belong to this sequence\n", checkpoint);
+        fclose(fp);
+        return -1;
+    }
+    dd->testing = testing;
+    dd->nkept = 0;
+    for (size_t r = 0; r < nranges; ++r) {
+        uint32_t start, end;
+        if (fscanf(fp, "%u %u", &start, &end) != 2 || start >= end || end > nops) {
+            fprintf(stderr, "%s is corrupted\n", checkpoint);
+            fclose(fp);
+            return -1;
+        }
+        for (uint32_t i = start; i < end; ++i)
+            dd->kept[dd->nkept++] = i;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Chunk @i of the current sequence when it is split into @granularity */
+static void chunk_bounds(const struct ddmin *dd, size_t i, size_t *start, size_t *end)
+{
+    *start = dd->nkept * i / dd->granularity;
+    *end = dd->nkept * (i + 1) / dd->granularity;
+}
+
+/*
+ * Candidate @dd->next: the chunks first, then their complements. With two
+ * chunks the complements are the chunks themselves, so they are skipped.
+ */
+static size_t make_candidate(const struct ddmin *dd, uint32_t *cand)
+{
+    size_t start, end, n = 0;
+
+    if (dd->next < dd->granularity) {
+        chunk_bounds(dd, dd->next, &start, &end);
+        for (size_t i = start; i < end; ++i)
+            cand[n++] = dd->kept[i];
+    } else {
+        chunk_bounds(dd, dd->next - dd->granularity, &start, &end);
+        for (size_t i = 0; i < dd->nkept; ++i)
+            if (i < start || i >= end)
+                cand[n++] = dd->kept[i];
+    }
+    return n;
+}
+
+static size_t round_candidates(const struct ddmin *dd)
+{
+    return dd->granularity == 2 ? 2 : dd->granularity * 2;
+}
+
+/* Move on after a test of candidate @dd->next, given its result */
+static void ddmin_step(struct ddmin *dd, bool reproduced, const uint32_t *cand,
+                       size_t ncand)
+{
+    if (reproduced) {
+        bool complement = dd->next >= dd->granularity;
+        memcpy(dd->kept, cand, ncand * sizeof(uint32_t));
+        dd->nkept = ncand;
+        dd->granularity = complement ? max(dd->granularity - 1, 2) : 2;
+        dd->granularity = min(dd->granularity, dd->nkept);
+        dd->next = 0;
+    } else if (++dd->next == round_candidates(dd)) {
+        /* Done once single ops have been tried; see minimize() */
+        if (dd->granularity >= dd->nkept)
+            dd->granularity = dd->nkept + 1;
+        else
+            dd->granularity = min(dd->granularity * 2, dd->nkept);
+        dd->next = 0;
+    }
+    dd->testing = false;
+}
+
+/* Replay the candidate in a child process and watch the kernel log */
+static enum test_result run_test(const char *dir, const struct replay_op *ops,
+                                 const uint32_t *cand, size_t ncand,
+                                 unsigned long iterations, unsigned long timeout)
+{
+    char report[PATH_MAX];
+    snprintf(report, sizeof(report), "%s/oops.txt", dir);
+
+    struct replay_op *cand_ops = malloc(ncand * sizeof(struct replay_op));
+    assert(cand_ops);
+    for (size_t i = 0; i < ncand; ++i)
+        cand_ops[i] = ops[cand[i]];
+
+    oops_detected = false;
+    if (oops_watch_start(report, cand_ops, ncand) != 0) {
+        free(cand_ops);
+        return TEST_ERROR;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        oops_watching = false;
+        replay_candidate(cand_ops, ncand, iterations);
+        exit(0);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Cannot fork (%s)\n", strerror(errno));
+        oops_watch_stop();
+        free(cand_ops);
+        return TEST_ERROR;
+    }
+
+    enum test_result result = TEST_PASSED;
+    uint64_t deadline = timeout ? now_ns() + timeout * 1000000000ull : 0;
+    int status;
+    for (;;) {
+        pid_t ret = waitpid(pid, &status, WNOHANG);
+        if (ret == pid) {
+            if (__atomic_load_n(&oops_detected, __ATOMIC_ACQUIRE))
+                result = TEST_REPRODUCED;
+            else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                result = TEST_ERROR;
+            goto out;
+        }
+        if (__atomic_load_n(&oops_detected, __ATOMIC_ACQUIRE) ||
+            (deadline && now_ns() >= deadline))
+            break;
+        usleep(10000);
+    }
+
+    /* Reproduced; the test may be stuck in the file system by now */
+    result = TEST_REPRODUCED;
+    kill(pid, SIGKILL);
+    for (int ms = 0; waitpid(pid, &status, WNOHANG) != pid; ms += 10) {
+        if (ms >= REAP_TIMEOUT_MS) {
+            result = TEST_STUCK;
+            break;
+        }
+        usleep(10000);
+    }
+out:
+    oops_watch_stop();
+    free(cand_ops);
+    return result;
+}
+
+static int write_result(const char *dir, const struct replay_op *ops,
+                        const struct ddmin *dd)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/minimized.log", dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < dd->nkept; ++i)
+        oplog_write_text(fp, &ops[dd->kept[i]]);
+    fclose(fp);
+    printf("Minimized sequence of %zu ops written to %s\n", dd->nkept, path);
+    return 0;
+}
+
+/*
+ * Minimize @ops, keeping its state in @dir. Returns the exit status of
+ * the replayer: 0 when done, 2 when the machine needs a reboot first.
+ */
+int minimize(const char *dir, const struct replay_op *ops, size_t nops,
+             unsigned long iterations, unsigned long timeout)
+{
+    struct ddmin dd = {.granularity = 2};
+    uint32_t *cand = malloc(nops * sizeof(uint32_t));
+
+    dd.kept = malloc(nops * sizeof(uint32_t));
+    assert(dd.kept && cand);
+    snprintf(checkpoint, sizeof(checkpoint), "%s/checkpoint", dir);
+
+    int ret = load_checkpoint(&dd, nops);
+    if (ret < 0)
+        return 1;
+    if (ret > 0) {
+        for (size_t i = 0; i < nops; ++i)
+            if (ops[i].opcode != OP_MAX)
+                dd.kept[dd.nkept++] = i;
+    } else {
+        printf("Resuming from %s with %zu ops\n", checkpoint, dd.nkept);
+    }
+    if (dd.testing) {
+        /* The last test took the machine down */
+        printf("Candidate %zu of the last run crashed the machine\n", dd.next);
+        size_t ncand = make_candidate(&dd, cand);
+        ddmin_step(&dd, true, cand, ncand);
+        if (save_checkpoint(&dd, nops) != 0)
+            return 1;
+    }
+
+    while (dd.nkept >= 2 && dd.granularity <= dd.nkept) {
+        size_t ncand = make_candidate(&dd, cand);
+        if (ncand == 0) {
+            ddmin_step(&dd, false, cand, ncand);
+            continue;
+        }
+
+        dd.testing = true;
+        if (save_checkpoint(&dd, nops) != 0)
+            return 1;
+        printf("Testing %zu of %zu ops (granularity %zu, candidate %zu)\n",
+               ncand, dd.nkept, dd.granularity, dd.next);
+        fflush(stdout);
+
+        enum test_result result = run_test(dir, ops, cand, ncand, iterations, timeout);
+        if (result == TEST_ERROR) {
+            dd.testing = false;
+            save_checkpoint(&dd, nops);
+            fprintf(stderr, "Test of candidate %zu failed\n", dd.next);
+            return 1;
+        }
+        printf("  -> %s\n", result == TEST_PASSED ? "passed" : "reproduced");
+        ddmin_step(&dd, result != TEST_PASSED, cand, ncand);
+        if (save_checkpoint(&dd, nops) != 0)
+            return 1;
+        if (result == TEST_STUCK) {
+            write_result(dir, ops, &dd);
+            printf("The file system is stuck; reboot and rerun the same "
+                   "command to continue\n");
+            return 2;
+        }
+    }
+
+    write_result(dir, ops, &dd);
+    free(cand);
+    free(dd.kept);
+    return 0;
+}
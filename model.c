@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Shadow model of the file system ("replay --verify").
+ *
+ * An in-memory model of the namespace under the mount point predicts the
+ * result of every op, and the replayer reports ops whose actual result
+ * differs. Every interned path maps to an inode of the model (or to
+ * nothing), so an op is checked with a few array lookups, without looking
+ * at the mounted file system. Inodes hold what the results depend on:
+ * type, link count, directory entries, symlink target and xattrs, plus
+ * size, mode and owner.
+ *
+ * The model is only updated with the effect of an op if both the model
+ * and the file system say it succeeded, so a single divergence is
+ * reported once instead of cascading. Ops the model cannot predict (e.g.
+ * through a symlink to a directory or out of the mount) are counted as
+ * unverified, and if they succeed, the paths they touched become unknown
+ * for the rest of the iteration.
+ */
+#include "replay.h"
+
+#define MODEL_MAX_XATTRS    8
+#define MODEL_MAX_LINKS     40      /* symlinks followed, like the kernel */
+#define UNKNOWN             (-2)
+
+enum model_type {
+    M_FILE,
+    M_DIR,
+    M_SYMLINK,
+};
+
+struct model_inode {
+    enum model_type type;
+    int nlink;              /* names referring to it */
+    int nentries;           /* entries of a directory */
+    int target;             /* path id a symlink points to, or UNKNOWN */
+    uint64_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    int nxattrs;
+    const char *xattrs[MODEL_MAX_XATTRS];
+    size_t xattr_size[MODEL_MAX_XATTRS];
+};
+
+bool verifying = false;
+
+static int *nodes;                  /* inode of each path id, -1 or UNKNOWN */
+static int nnodes;
+static struct model_inode *inodes;
+static int ninodes, inodes_cap;
+static int *free_inodes;
+static int nfree;
+static int root;                    /* path id of the mount point */
+static int root_inode;
+static mode_t model_umask;
+
+static struct {
+    uint64_t verified;
+    uint64_t mismatches;
+    uint64_t unverified;
+} model_stats;
+
+uint64_t model_mismatches;
+
+static int *node(int id)
+{
+    if (id >= nnodes) {
+        int n = max(path_count(), id + 1);
+        nodes = realloc(nodes, n * sizeof(int));
+        assert(nodes);
+        for (int i = nnodes; i < n; ++i)
+            nodes[i] = -1;
+        nnodes = n;
+    }
+    return &nodes[id];
+}
+
+static int inode_new(enum model_type type, mode_t mode)
+{
+    int ino;
+
+    if (nfree > 0) {
+        ino = free_inodes[--nfree];
+    } else {
+        if (ninodes == inodes_cap) {
+            inodes_cap = inodes_cap ? inodes_cap * 2 : 64;
+            inodes = realloc(inodes, inodes_cap * sizeof(*inodes));
+            free_inodes = realloc(free_inodes, inodes_cap * sizeof(int));
+            assert(inodes && free_inodes);
+        }
+        ino = ninodes++;
+    }
+    memset(&inodes[ino], 0, sizeof(inodes[ino]));
+    inodes[ino].type = type;
+    inodes[ino].mode = mode;
+    inodes[ino].uid = geteuid();
+    inodes[ino].gid = getegid();
+    inodes[ino].target = UNKNOWN;
+    return ino;
+}
+
+static void inode_put(int ino)
+{
+    if (--inodes[ino].nlink == 0)
+        free_inodes[nfree++] = ino;
+}
+
+static int lookup(int id, bool follow, int *last, int *err);
+
+/* Directory inode a path id lives in, -1 with @err set, or UNKNOWN */
+static int lookup_parent(int id, int *err)
+{
+    int parent = path_parent(id);
+    if (parent < 0 || id == root)
+        return UNKNOWN;
+    int ino = lookup(parent, false, NULL, err);
+    if (ino < 0)
+        return ino;
+    /* Children of a symlinked directory are other path ids */
+    if (inodes[ino].type == M_SYMLINK)
+        return UNKNOWN;
+    if (inodes[ino].type != M_DIR) {
+        *err = ENOTDIR;
+        return -1;
+    }
+    return ino;
+}
+
+/*
+ * Inode of path @id, following a symlink in the last component if
+ * @follow. Returns -1 with @err set if the lookup fails; if that is
+ * because the last component is missing, @last is the path id it could
+ * be created at. Returns UNKNOWN if the model cannot tell.
+ */
+static int lookup(int id, bool follow, int *last, int *err)
+{
+    if (last)
+        *last = -1;
+    for (int hops = 0; ; ++hops) {
+        if (id == root)
+            return root_inode;
+        int pino = lookup_parent(id, err);
+        if (pino < 0)
+            return pino;
+        int ino = *node(id);
+        if (ino == UNKNOWN)
+            return UNKNOWN;
+        if (ino < 0) {
+            *err = ENOENT;
+            if (last)
+                *last = id;
+            return -1;
+        }
+        if (!follow || inodes[ino].type != M_SYMLINK)
+            return ino;
+        if (hops == MODEL_MAX_LINKS) {
+            *err = ELOOP;
+            return -1;
+        }
+        id = inodes[ino].target;
+        if (id == UNKNOWN)
+            return UNKNOWN;
+    }
+}
+
+/* Add a new inode at path @id in directory @pino */
+static int model_create(int id, int pino, enum model_type type, mode_t mode)
+{
+    const struct model_inode *dir = &inodes[pino];
+    int ino = inode_new(type, mode & 07777);
+    struct model_inode *in = &inodes[ino];
+
+    in->nlink = 1;
+    if (dir->mode & S_ISGID) {
+        /* BSD group semantics, with the bit inherited by directories */
+        in->gid = dir->gid;
+        if (type == M_DIR)
+            in->mode |= S_ISGID;
+    }
+    *node(id) = ino;
+    inodes[pino].nentries++;
+    return ino;
+}
+
+static void model_remove(int id, int pino)
+{
+    inode_put(*node(id));
+    *node(id) = -1;
+    inodes[pino].nentries--;
+}
+
+/* open(2) of path @id, creating it if asked to */
+static int model_open(int id, int flags, mode_t mode, bool apply, int *err)
+{
+    bool excl = (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL);
+    int last;
+    int ino = lookup(id, !excl && !(flags & O_NOFOLLOW), &last, err);
+
+    if (ino == UNKNOWN)
+        return UNKNOWN;
+    if (ino >= 0) {
+        const struct model_inode *in = &inodes[ino];
+        if (excl) {
+            *err = EEXIST;
+            return -1;
+        }
+        if (in->type == M_SYMLINK) {
+            *err = ELOOP;       /* O_NOFOLLOW */
+            return -1;
+        }
+        if (in->type == M_DIR && ((flags & O_ACCMODE) != O_RDONLY || (flags & O_CREAT))) {
+            *err = EISDIR;
+            return -1;
+        }
+        if (apply && (flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY)
+            inodes[ino].size = 0;
+        return ino;
+    }
+    if (!(flags & O_CREAT) || last < 0)
+        return -1;
+
+    /* Create the file, which may be the target of a dangling symlink */
+    int pino = lookup_parent(last, err);
+    if (pino < 0)
+        return pino;
+    if (!apply)
+        return 0;
+    return model_create(last, pino, M_FILE, mode & ~model_umask);
+}
+
+static int xattr_find(const struct model_inode *in, const char *name)
+{
+    for (int i = 0; i < in->nxattrs; ++i) {
+        if (strcmp(in->xattrs[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Predict the result of @op into @ret and @err, and apply its effect if
+ * @apply. Returns false if the model cannot predict it.
+ */
+static bool model_op(const struct replay_op *op, bool apply, int *ret, int *err)
+{
+    int ino, pino, x;
+    struct model_inode *in;
+
+    *ret = -1;
+    *err = 0;
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        ino = model_open(op->path_id, op->flags, op->mode, apply, err);
+        if (ino == UNKNOWN)
+            return false;
+        if (ino >= 0)
+            *ret = 0;
+        return true;
+    case OP_WRITE_FILE:
+        ino = model_open(op->path_id, op->flags, 0, apply, err);
+        if (ino == UNKNOWN)
+            return false;
+        if (ino < 0)
+            return true;
+        if ((op->flags & O_ACCMODE) == O_RDONLY) {
+            *err = EBADF;
+            return true;
+        }
+        *ret = (int)op->length;
+        if (apply && op->length > 0) {
+            in = &inodes[ino];
+            uint64_t off = (op->flags & O_APPEND) ? in->size : (uint64_t)op->offset;
+            in->size = max(in->size, off + op->length);
+            in->mode &= ~S_ISUID;
+        }
+        return true;
+    case OP_TRUNCATE:
+        ino = lookup(op->path_id, true, NULL, err);
+        if (ino == UNKNOWN)
+            return false;
+        if (ino < 0)
+            return true;
+        if (inodes[ino].type == M_DIR) {
+            *err = EISDIR;
+        } else if ((off_t)op->length < 0) {
+            *err = EINVAL;
+        } else {
+            *ret = 0;
+            if (apply)
+                inodes[ino].size = op->length;
+        }
+        return true;
+    case OP_MKDIR:
+    case OP_SYMLINK:
+    {
+        int id = op->opcode == OP_MKDIR ? op->path_id : op->path2_id;
+        pino = lookup_parent(id, err);
+        if (pino == UNKNOWN || *node(id) == UNKNOWN)
+            return false;
+        if (pino < 0)
+            return true;
+        if (*node(id) >= 0) {
+            *err = EEXIST;
+            return true;
+        }
+        *ret = 0;
+        if (apply && op->opcode == OP_MKDIR) {
+            model_create(id, pino, M_DIR, op->mode & ~model_umask);
+        } else if (apply) {
+            ino = model_create(id, pino, M_SYMLINK, 0777);
+            inodes[ino].target = op->path_id;
+            inodes[ino].size = strlen(op->path);
+        }
+        return true;
+    }
+    case OP_RMDIR:
+    case OP_UNLINK:
+        if (op->path_id == root) {
+            *err = op->opcode == OP_RMDIR ? EBUSY : EISDIR;
+            return true;
+        }
+        pino = lookup_parent(op->path_id, err);
+        if (pino == UNKNOWN || *node(op->path_id) == UNKNOWN)
+            return false;
+        if (pino < 0)
+            return true;
+        ino = *node(op->path_id);
+        if (ino < 0) {
+            *err = ENOENT;
+        } else if (op->opcode == OP_UNLINK && inodes[ino].type == M_DIR) {
+            *err = EISDIR;
+        } else if (op->opcode == OP_RMDIR && inodes[ino].type != M_DIR) {
+            *err = ENOTDIR;
+        } else if (op->opcode == OP_RMDIR && inodes[ino].nentries > 0) {
+            *err = ENOTEMPTY;
+        } else {
+            *ret = 0;
+            if (apply)
+                model_remove(op->path_id, pino);
+        }
+        return true;
+    case OP_LINK:
+        ino = lookup(op->path_id, false, NULL, err);
+        if (ino == UNKNOWN)
+            return false;
+        if (ino < 0)
+            return true;
+        pino = lookup_parent(op->path2_id, err);
+        if (pino == UNKNOWN || *node(op->path2_id) == UNKNOWN)
+            return false;
+        if (pino < 0)
+            return true;
+        if (*node(op->path2_id) >= 0) {
+            *err = EEXIST;
+        } else if (inodes[ino].type == M_DIR) {
+            *err = EPERM;
+        } else {
+            *ret = 0;
+            if (apply) {
+                *node(op->path2_id) = ino;
+                inodes[ino].nlink++;
+                inodes[pino].nentries++;
+            }
+        }
+        return true;
+    case OP_CHMOD:
+    case OP_CHOWN:
+    case OP_CHGRP:
+        ino = lookup(op->path_id, true, NULL, err);
+        if (ino == UNKNOWN)
+            return false;
+        if (ino < 0)
+            return true;
+        *ret = 0;
+        if (!apply)
+            return true;
+        in = &inodes[ino];
+        if (op->opcode == OP_CHMOD) {
+            in->mode = op->mode & 07777;
+            return true;
+        }
+        if (op->opcode == OP_CHOWN)
+            in->uid = op->mode;
+        else
+            in->gid = op->mode;
+        if (in->type != M_DIR) {
+            in->mode &= ~S_ISUID;
+            if (in->mode & S_IXGRP)
+                in->mode &= ~S_ISGID;
+        }
+        return true;
+    case OP_SETXATTR:
+    case OP_REMOVEXATTR:
+        ino = lookup(op->path_id, true, NULL, err);
+        if (ino == UNKNOWN)
+            return false;
+        if (ino < 0)
+            return true;
+        in = &inodes[ino];
+        x = xattr_find(in, op->path2);
+        if (op->opcode == OP_REMOVEXATTR) {
+            if (x < 0) {
+                *err = ENODATA;
+                return true;
+            }
+            *ret = 0;
+            if (apply) {
+                in->nxattrs--;
+                in->xattrs[x] = in->xattrs[in->nxattrs];
+                in->xattr_size[x] = in->xattr_size[in->nxattrs];
+            }
+            return true;
+        }
+        if (op->path2[0] == '\0') {
+            *err = ERANGE;
+        } else if (op->length > XATTR_SIZE_MAX) {
+            *err = E2BIG;
+        } else if ((op->flags & XATTR_CREATE) && x >= 0) {
+            *err = EEXIST;
+        } else if ((op->flags & XATTR_REPLACE) && x < 0) {
+            *err = ENODATA;
+        } else if (x < 0 && in->nxattrs == MODEL_MAX_XATTRS) {
+            return false;
+        } else {
+            *ret = 0;
+            if (apply && x < 0) {
+                x = in->nxattrs++;
+                in->xattrs[x] = str_intern(op->path2);
+            }
+            if (apply)
+                in->xattr_size[x] = op->length;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Mark the paths of @op as unknown after it did something unpredicted */
+static void model_forget(const struct replay_op *op)
+{
+    if (op->path_id >= 0 && op->path_id != root)
+        *node(op->path_id) = UNKNOWN;
+    if (op->path2_id >= 0 && op->path2_id != root &&
+        (op->opcode == OP_LINK || op->opcode == OP_SYMLINK))
+        *node(op->path2_id) = UNKNOWN;
+}
+
+/* Compare the result of op @seq with the model's prediction, then apply it */
+void model_check(const struct replay_op *op, int seq, int ret, int err)
+{
+    int exp_ret, exp_err;
+
+    if (!model_op(op, false, &exp_ret, &exp_err)) {
+        model_stats.unverified++;
+        if (ret >= 0)
+            model_forget(op);
+        return;
+    }
+    model_stats.verified++;
+    if (exp_ret == ret && (ret >= 0 || exp_err == err)) {
+        if (ret >= 0)
+            model_op(op, true, &exp_ret, &exp_err);
+        return;
+    }
+
+    char call[3 * PATH_MAX];
+    format_op(call, sizeof(call), op);
+    fprintf(stderr, "Mismatch at seq=%d: %s -> ret=%d, errno=%s, "
+            "the model expected ret=%d, errno=%s\n", seq, call, ret,
+            strerror(err), exp_ret, strerror(exp_err));
+    model_stats.mismatches++;
+    model_mismatches++;
+    if (ret >= 0)
+        model_forget(op);
+}
+
+/* The pre-populated state, as created by prepopulate() */
+void model_reset()
+{
+    mode_t mask = umask(0);
+    umask(mask);
+    model_umask = mask;
+
+    nfree = 0;
+    ninodes = 0;
+    for (int i = 0; i < nnodes; ++i)
+        nodes[i] = -1;
+    memset(&model_stats, 0, sizeof(model_stats));
+    root = path_intern(basepath);
+    node(root);
+    root_inode = inode_new(M_DIR, 0755);
+    inodes[root_inode].nlink = 2;
+
+    for (size_t i = 0; i < file_dir_count; ++i) {
+        char path[PATH_MAX];
+        size_t rootlen = strlen(basepath);
+        bool next_f = false, next_d = false;
+        int err;
+
+        snprintf(path, sizeof(path), "%s%s", basepath, file_dir_array[i]);
+        /* Same steps as mkdir_p() */
+        for (size_t n = rootlen + 1; path[n]; ++n) {
+            if (path[n] != '/')
+                continue;
+            int id = path_intern_len(path, n);
+            int pino = lookup_parent(id, &err);
+            if (pino >= 0 && *node(id) < 0)
+                model_create(id, pino, M_DIR, 0755 & ~model_umask);
+            if (path[n + 1] == 'f')
+                next_f = true;
+            else if (path[n + 1] == 'd')
+                next_d = true;
+        }
+        int id = path_intern(path);
+        int pino = lookup_parent(id, &err);
+        if (pino >= 0 && next_f && *node(id) < 0)
+            model_create(id, pino, M_FILE, 0644 & ~model_umask);
+        if (pino >= 0 && next_d && *node(id) < 0)
+            model_create(id, pino, M_DIR, 0755 & ~model_umask);
+    }
+}
+
+void print_model_stats()
+{
+    printf("model: %lu ops verified, %lu mismatches, %lu unverified\n",
+           (unsigned long)model_stats.verified,
+           (unsigned long)model_stats.mismatches,
+           (unsigned long)model_stats.unverified);
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Mounting through the new mount API ("replay --mount-api fsopen").
+ *
+ * mount(2) resolves the file system type, the device and the mount point
+ * from strings on every call. Here the file system context for the next
+ * mount is opened and given its source as soon as the previous mount is
+ * done, and the mount point is held open, so a mount cycle only creates
+ * the superblock, makes a mount of it and attaches that mount. The
+ * context cannot be kept across cycles: it holds a reference to the
+ * superblock, which would keep umount from really shutting the file
+ * system down.
+ */
+#include "replay.h"
+#include <sys/syscall.h>
+
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC              0x00000001
+#define FSMOUNT_CLOEXEC             0x00000001
+#define FSCONFIG_SET_STRING         1
+#define FSCONFIG_CMD_CREATE         6
+#define MOVE_MOUNT_F_EMPTY_PATH     0x00000004
+#define MOVE_MOUNT_T_EMPTY_PATH     0x00000040
+#define MOUNT_ATTR_NOATIME          0x00000010
+#endif
+
+static struct {
+    const char *fsys;
+    const char *device;
+    int fsfd;               /* context of the next mount, source set */
+    int target;             /* O_PATH fd of the mount point */
+} fsm = {.fsfd = -1, .target = -1};
+
+static int fsm_prepare()
+{
+    fsm.fsfd = syscall(SYS_fsopen, fsm.fsys, FSOPEN_CLOEXEC);
+    if (fsm.fsfd < 0)
+        return -1;
+    if (syscall(SYS_fsconfig, fsm.fsfd, FSCONFIG_SET_STRING, "source",
+                fsm.device, 0) != 0) {
+        int err = errno;
+        close(fsm.fsfd);
+        fsm.fsfd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int fsm_init(const char *fsys, const char *device, const char *basepath)
+{
+    fsm.fsys = fsys;
+    fsm.device = device;
+    fsm.target = open(basepath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fsm.target < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", basepath, strerror(errno));
+        return -1;
+    }
+    if (fsm_prepare() != 0) {
+        fprintf(stderr, "Cannot set up a %s context for %s (%s)\n",
+                fsys, device, strerror(errno));
+        close(fsm.target);
+        fsm.target = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Mount the file system; returns -1 and sets errno on failure */
+int fsm_mount()
+{
+    int err;
+
+    if (fsm.fsfd < 0 && fsm_prepare() != 0)
+        return -1;
+    if (syscall(SYS_fsconfig, fsm.fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) != 0)
+        goto err;
+    int mfd = syscall(SYS_fsmount, fsm.fsfd, FSMOUNT_CLOEXEC, MOUNT_ATTR_NOATIME);
+    if (mfd < 0)
+        goto err;
+    if (syscall(SYS_move_mount, mfd, "", fsm.target, "",
+                MOVE_MOUNT_F_EMPTY_PATH | MOVE_MOUNT_T_EMPTY_PATH) != 0) {
+        err = errno;
+        close(mfd);
+        errno = err;
+        goto err;
+    }
+    close(mfd);
+    close(fsm.fsfd);
+    /* Get the context of the next mount ready while this one is in use */
+    fsm_prepare();
+    return 0;
+
+err:
+    /* A context that failed to create a superblock cannot be retried */
+    err = errno;
+    close(fsm.fsfd);
+    fsm.fsfd = -1;
+    errno = err;
+    return -1;
+}
+
+void fsm_exit()
+{
+    if (fsm.fsfd >= 0)
+        close(fsm.fsfd);
+    if (fsm.target >= 0)
+        close(fsm.target);
+    fsm.fsfd = fsm.target = -1;
+}
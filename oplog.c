@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Sequence log handling: parsing the text log into struct replay_op, and
+ * compiling it into / loading it from the binary op stream format.
+ */
+#include "replay.h"
+#include <sys/mman.h>
+
+const char *op_names[OP_MAX] = {
+    [OP_CREATE_FILE] = "create_file",
+    [OP_WRITE_FILE] = "write_file",
+    [OP_TRUNCATE] = "truncate",
+    [OP_MKDIR] = "mkdir",
+    [OP_RMDIR] = "rmdir",
+    [OP_SYMLINK] = "symlink",
+    [OP_LINK] = "link",
+    [OP_UNLINK] = "unlink",
+    [OP_CHMOD] = "chmod",
+    [OP_CHGRP] = "chgrp_file",
+    [OP_CHOWN] = "chown_file",
+    [OP_REMOVEXATTR] = "removexattr",
+    [OP_SETXATTR] = "setxattr",
+};
+
+/* Number of fields (including the op name) each op takes in the text log */
+static const int op_nfields[OP_MAX] = {
+    [OP_CREATE_FILE] = 4,
+    [OP_WRITE_FILE] = 6,
+    [OP_TRUNCATE] = 3,
+    [OP_MKDIR] = 3,
+    [OP_RMDIR] = 2,
+    [OP_SYMLINK] = 3,
+    [OP_LINK] = 3,
+    [OP_UNLINK] = 2,
+    [OP_CHMOD] = 3,
+    [OP_CHGRP] = 3,
+    [OP_CHOWN] = 3,
+    [OP_REMOVEXATTR] = 3,
+    [OP_SETXATTR] = 6,
+};
+
+/*
+ * Returns the opcode of an op name of @len bytes, or OP_MAX if it is not
+ * recognized. The length and one distinguishing character select a single
+ * candidate, which is then compared in full, so every name costs at most
+ * one memcmp regardless of how many ops there are.
+ */
+enum op_code op_lookup(const char *name, size_t len)
+{
+    enum op_code op = OP_MAX;
+
+    switch (len) {
+    case 4:
+        op = OP_LINK;
+        break;
+    case 5:
+        if (name[0] == 'm')
+            op = OP_MKDIR;
+        else if (name[0] == 'r')
+            op = OP_RMDIR;
+        else
+            op = OP_CHMOD;
+        break;
+    case 6:
+        op = OP_UNLINK;
+        break;
+    case 7:
+        op = OP_SYMLINK;
+        break;
+    case 8:
+        op = (name[0] == 't') ? OP_TRUNCATE : OP_SETXATTR;
+        break;
+    case 10:
+        if (name[0] == 'w')
+            op = OP_WRITE_FILE;
+        else if (name[2] == 'g')
+            op = OP_CHGRP;
+        else
+            op = OP_CHOWN;
+        break;
+    case 11:
+        op = (name[0] == 'c') ? OP_CREATE_FILE : OP_REMOVEXATTR;
+        break;
+    }
+    if (op != OP_MAX && memcmp(name, op_names[op], len) != 0)
+        op = OP_MAX;
+    return op;
+}
+
+/*
+ * Split the @len bytes at @line into fields separated by runs of
+ * characters in @delim, like strtok() but reentrant and without touching
+ * the line: each field is recorded as a slice of it, so the line can be
+ * read-only, e.g. a mapping of the log. The line has to be followed by a
+ * newline or a NUL. Fields past FIELDS_MAX are ignored. Returns the
+ * number of fields.
+ */
+int split_fields(struct fields *fields, const char *line, size_t len,
+                 const char *delim)
+{
+    const char *p = line, *end = line + len;
+    char stop[16];
+
+    /* Also stop at the newline, so that the scans stay within the line */
+    snprintf(stop, sizeof(stop), "%s\n", delim);
+    fields->n = 0;
+    for (;;) {
+        p += strspn(p, delim);
+        if (p >= end || *p == '\0')
+            break;
+        const char *start = p;
+        p += strcspn(p, stop);
+        if (p > end)
+            p = end;
+        if (fields->n < FIELDS_MAX) {
+            fields->f[fields->n].ptr = start;
+            fields->f[fields->n].len = p - start;
+            fields->n++;
+        }
+    }
+    return fields->n;
+}
+
+/*
+ * Map a text log for a single sequential pass. Lines are returned in
+ * place by logfile_next(); only a last line without a newline is copied,
+ * so that numbers at the very end of the mapping can be parsed safely.
+ */
+int logfile_open(struct logfile *lf, const char *path)
+{
+    memset(lf, 0, sizeof(*lf));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    lf->size = st.st_size;
+    if (lf->size > 0) {
+        lf->map = mmap(NULL, lf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (lf->map == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            lf->map = NULL;
+            errno = err;
+            return -1;
+        }
+        madvise(lf->map, lf->size, MADV_SEQUENTIAL);
+        madvise(lf->map, lf->size, MADV_WILLNEED);
+    }
+    close(fd);
+    return 0;
+}
+
+/* Returns the next line (without its newline) in @line/@len, or false */
+bool logfile_next(struct logfile *lf, const char **line, size_t *len)
+{
+    if (lf->pos >= lf->size)
+        return false;
+    const char *start = lf->map + lf->pos;
+    const char *nl = memchr(start, '\n', lf->size - lf->pos);
+    if (nl) {
+        *line = start;
+        *len = nl - start;
+        lf->pos += *len + 1;
+        return true;
+    }
+    *len = min(lf->size - lf->pos, sizeof(lf->tail) - 1);
+    memcpy(lf->tail, start, *len);
+    lf->tail[*len] = '\0';
+    *line = lf->tail;
+    lf->pos = lf->size;
+    return true;
+}
+
+void logfile_close(struct logfile *lf)
+{
+    if (lf->map)
+        munmap(lf->map, lf->size);
+    lf->map = NULL;
+}
+
+/* Intern the path or string in field @i, which is not NUL-terminated */
+static int intern_path_field(const struct fields *argv, int i)
+{
+    return path_intern_len(argv->f[i].ptr, argv->f[i].len);
+}
+
+static const char *intern_str_field(const struct fields *argv, int i)
+{
+    return str_intern_len(argv->f[i].ptr, argv->f[i].len);
+}
+
+/*
+ * Decode the fields of a log line into @op. Numbers are parsed straight
+ * out of the line, since they end at a delimiter or the newline; the
+ * strings in @op are interned, so they stay valid after the line is gone.
+ * Returns -1 if the op is not recognized (op->opcode is set to OP_MAX) or
+ * if it does not have enough fields.
+ */
+int parse_op(const struct fields *argv, struct replay_op *op)
+{
+    const char *fields[FIELDS_MAX];
+    char *endp;
+
+    memset(op, 0, sizeof(*op));
+    op->opcode = OP_MAX;
+    if (argv->n == 0)
+        return -1;
+    for (int i = 0; i < argv->n; ++i)
+        fields[i] = argv->f[i].ptr;
+    op->opcode = op_lookup(fields[0], argv->f[0].len);
+    if (op->opcode == OP_MAX)
+        return -1;
+    if (argv->n < op_nfields[op->opcode]) {
+        op->opcode = OP_MAX;
+        return -1;
+    }
+
+    op->path_id = intern_path_field(argv, 1);
+    op->path = path_str(op->path_id);
+    op->path2_id = -1;
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        op->flags = (int)strtol(fields[2], &endp, 8);
+        op->mode = (mode_t)strtol(fields[3], &endp, 8);
+        break;
+    case OP_WRITE_FILE:
+        /* fields[3] is the address of the buffer in the original run */
+        op->flags = (int)strtol(fields[2], &endp, 8);
+        op->offset = strtol(fields[4], &endp, 10);
+        op->length = strtoul(fields[5], &endp, 10);
+        assert(op->offset != LONG_MAX);
+        assert(op->length != ULONG_MAX);
+        break;
+    case OP_TRUNCATE:
+        op->length = atol(fields[2]);
+        break;
+    case OP_MKDIR:
+    case OP_CHMOD:
+        op->mode = (mode_t)strtol(fields[2], &endp, 8);
+        break;
+    case OP_SYMLINK:
+    case OP_LINK:
+        op->path2_id = intern_path_field(argv, 2);
+        op->path2 = path_str(op->path2_id);
+        break;
+    case OP_CHGRP:
+    case OP_CHOWN:
+        op->mode = strtoul(fields[2], &endp, 10);
+        break;
+    case OP_REMOVEXATTR:
+        op->path2 = intern_str_field(argv, 2);
+        break;
+    case OP_SETXATTR:
+        op->path2 = intern_str_field(argv, 2);
+        op->value = intern_str_field(argv, 3);
+        op->length = strtoul(fields[4], &endp, 10);
+        op->flags = (int)strtol(fields[5], &endp, 0);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/*
+ * Parse the whole text log at @logpath into @ops (a vector of struct
+ * replay_op) so it can be replayed any number of times. Unrecognized lines
+ * are kept as OP_MAX ops so that the seq numbers of the following ops do
+ * not change.
+ */
+int oplog_load_text(const char *logpath, vector_t *ops)
+{
+    struct logfile lf;
+    const char *line;
+    size_t len;
+    unsigned long lineno = 0;
+
+    if (logfile_open(&lf, logpath) != 0) {
+        printf("Cannot open %s. Does it exist?\n", logpath);
+        return -1;
+    }
+
+    vector_init(ops, struct replay_op, 1024);
+    while (logfile_next(&lf, &line, &len)) {
+        struct replay_op op;
+        struct fields argv;
+
+        lineno++;
+        split_fields(&argv, line, len, ", ");
+        if (parse_op(&argv, &op) != 0) {
+            printf("Unrecognized op at %s:%lu: %.*s\n", logpath, lineno,
+                   argv.n ? (int)argv.f[0].len : 0, argv.n ? argv.f[0].ptr : "");
+        }
+        vector_add(ops, &op);
+    }
+
+    logfile_close(&lf);
+    return 0;
+}
+
+static inline uint32_t str_hash(const char *s, size_t len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void strtab_init(struct strtab *tab)
+{
+    tab->nstrs = 0;
+    tab->cap = 64;
+    tab->strs = calloc(tab->cap, sizeof(char *));
+    tab->nslots = 128;
+    tab->slots = calloc(tab->nslots, sizeof(uint32_t));
+    assert(tab->strs && tab->slots);
+}
+
+void strtab_destroy(struct strtab *tab)
+{
+    for (uint32_t i = 0; i < tab->nstrs; ++i)
+        free(tab->strs[i]);
+    free(tab->strs);
+    free(tab->slots);
+    memset(tab, 0, sizeof(*tab));
+}
+
+static void strtab_rehash(struct strtab *tab)
+{
+    free(tab->slots);
+    tab->nslots *= 2;
+    tab->slots = calloc(tab->nslots, sizeof(uint32_t));
+    assert(tab->slots);
+    for (uint32_t id = 0; id < tab->nstrs; ++id) {
+        uint32_t i = str_hash(tab->strs[id], strlen(tab->strs[id])) & (tab->nslots - 1);
+        while (tab->slots[i] != 0)
+            i = (i + 1) & (tab->nslots - 1);
+        tab->slots[i] = id + 1;
+    }
+}
+
+/*
+ * Intern the @len bytes at @s, which need not be NUL-terminated. Returns
+ * the id of the string, adding it to the table if it is not there yet.
+ */
+uint32_t strtab_intern_len(struct strtab *tab, const char *s, size_t len)
+{
+    uint32_t i = str_hash(s, len) & (tab->nslots - 1);
+    while (tab->slots[i] != 0) {
+        uint32_t id = tab->slots[i] - 1;
+        if (strncmp(tab->strs[id], s, len) == 0 && tab->strs[id][len] == '\0')
+            return id;
+        i = (i + 1) & (tab->nslots - 1);
+    }
+
+    if (tab->nstrs == tab->cap) {
+        tab->cap *= 2;
+        tab->strs = realloc(tab->strs, tab->cap * sizeof(char *));
+        assert(tab->strs);
+    }
+    uint32_t id = tab->nstrs++;
+    tab->strs[id] = strndup(s, len);
+    assert(tab->strs[id]);
+    tab->slots[i] = id + 1;
+    if (tab->nstrs * 2 > tab->nslots)
+        strtab_rehash(tab);
+    return id;
+}
+
+uint32_t strtab_intern(struct strtab *tab, const char *s)
+{
+    return strtab_intern_len(tab, s, strlen(s));
+}
+
+static int intern_field(struct strtab *tab, const char *s, uint16_t *id)
+{
+    if (s == NULL) {
+        *id = OPLOG_NOSTR;
+        return 0;
+    }
+    uint32_t sid = strtab_intern(tab, s);
+    if (sid >= OPLOG_NOSTR) {
+        fprintf(stderr, "Too many distinct strings in the sequence log\n");
+        return -1;
+    }
+    *id = (uint16_t)sid;
+    return 0;
+}
+
+/* Write @op as a line of the text sequence log */
+void oplog_write_text(FILE *fp, const struct replay_op *op)
+{
+    fprintf(fp, "%s, %s", op_names[op->opcode], op->path);
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        fprintf(fp, ", %o, 0%o", op->flags, op->mode);
+        break;
+    case OP_WRITE_FILE:
+        fprintf(fp, ", %o, 0, %ld, %lu", op->flags, op->offset, op->length);
+        break;
+    case OP_TRUNCATE:
+        fprintf(fp, ", %lu", op->length);
+        break;
+    case OP_MKDIR:
+    case OP_CHMOD:
+        fprintf(fp, ", 0%o", op->mode);
+        break;
+    case OP_SYMLINK:
+    case OP_LINK:
+    case OP_REMOVEXATTR:
+        fprintf(fp, ", %s", op->path2);
+        break;
+    case OP_CHGRP:
+    case OP_CHOWN:
+        fprintf(fp, ", %u", (unsigned)op->mode);
+        break;
+    case OP_SETXATTR:
+        fprintf(fp, ", %s, %s, %lu, %d", op->path2, op->value, op->length,
+                op->flags);
+        break;
+    default:
+        break;
+    }
+    fputc('\n', fp);
+}
+
+/* Pick up the strings of paths moved by path_rebase() */
+void oplog_rebase(struct oplog *log)
+{
+    for (uint32_t i = 0; i < log->nstrings; ++i)
+        if (log->path_ids[i] >= 0)
+            log->strings[i] = path_str(log->path_ids[i]);
+}
+
+/*
+ * Convert the text sequence log at @logpath into a binary op stream at
+ * @outpath. Unrecognized lines are fatal so that a compiled stream always
+ * replays exactly what the text log would.
+ */
+int oplog_compile(const char *logpath, const char *outpath)
+{
+    struct oplog_header hdr;
+    struct strtab tab;
+    struct logfile in;
+    const char *line;
+    size_t len;
+    int ret = -1;
+
+    if (logfile_open(&in, logpath) != 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", logpath, strerror(errno));
+        return -1;
+    }
+    FILE *out = fopen(outpath, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot create %s (%s)\n", outpath, strerror(errno));
+        logfile_close(&in);
+        return -1;
+    }
+
+    strtab_init(&tab);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, OPLOG_MAGIC, sizeof(OPLOG_MAGIC));
+    hdr.version = OPLOG_VERSION;
+    hdr.record_size = sizeof(struct op_record);
+    hdr.records_off = sizeof(hdr);
+    /* The header is rewritten once the counts are known */
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        goto write_err;
+
+    while (logfile_next(&in, &line, &len)) {
+        struct replay_op op;
+        struct op_record rec;
+        struct fields argv;
+
+        split_fields(&argv, line, len, ", ");
+        if (parse_op(&argv, &op) != 0) {
+            fprintf(stderr, "%s:%lu: cannot parse op '%.*s'\n", logpath,
+                    (unsigned long)hdr.nrecords + 1,
+                    argv.n ? (int)argv.f[0].len : 0, argv.n ? argv.f[0].ptr : "");
+            goto out;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        rec.opcode = op.opcode;
+        if (intern_field(&tab, op.path, &rec.path) != 0 ||
+            intern_field(&tab, op.path2, &rec.path2) != 0 ||
+            intern_field(&tab, op.value, &rec.value) != 0)
+            goto out;
+        rec.flags = op.flags;
+        rec.mode = op.mode;
+        rec.offset = op.offset;
+        rec.length = op.length;
+
+        if (fwrite(&rec, sizeof(rec), 1, out) != 1)
+            goto write_err;
+        hdr.nrecords++;
+    }
+
+    /* String table: offsets first, then the strings themselves */
+    hdr.nstrings = tab.nstrs;
+    hdr.strtab_off = hdr.records_off + hdr.nrecords * sizeof(struct op_record);
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < tab.nstrs; ++i) {
+        if (fwrite(&off, sizeof(off), 1, out) != 1)
+            goto write_err;
+        off += strlen(tab.strs[i]) + 1;
+    }
+    hdr.strtab_size = off;
+    for (uint32_t i = 0; i < tab.nstrs; ++i) {
+        if (fwrite(tab.strs[i], strlen(tab.strs[i]) + 1, 1, out) != 1)
+            goto write_err;
+    }
+
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+        goto write_err;
+    printf("Compiled %lu ops with %u distinct strings into %s\n",
+           (unsigned long)hdr.nrecords, hdr.nstrings, outpath);
+    ret = 0;
+    goto out;
+
+write_err:
+    fprintf(stderr, "Cannot write %s (%s)\n", outpath, strerror(errno));
+out:
+    if (fclose(out) != 0 && ret == 0) {
+        fprintf(stderr, "Cannot write %s (%s)\n", outpath, strerror(errno));
+        ret = -1;
+    }
+    logfile_close(&in);
+    strtab_destroy(&tab);
+    if (ret != 0)
+        unlink(outpath);
+    return ret;
+}
+
+/*
+ * Map a compiled op stream into memory. Everything is validated up front
+ * so the replay loop can index records and strings without checks.
+ */
+int oplog_open(struct oplog *log, const char *path)
+{
+    struct stat st;
+    const struct oplog_header *hdr;
+
+    memset(log, 0, sizeof(*log));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot stat %s (%s)\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s is not a compiled op stream\n", path);
+        close(fd);
+        return -1;
+    }
+    log->mapsize = st.st_size;
+    log->map = mmap(NULL, log->mapsize, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                    fd, 0);
+    close(fd);
+    if (log->map == MAP_FAILED) {
+        fprintf(stderr, "Cannot mmap %s (%s)\n", path, strerror(errno));
+        log->map = NULL;
+        return -1;
+    }
+    /* Advice values are not flags; each one needs its own call */
+    madvise(log->map, log->mapsize, MADV_SEQUENTIAL);
+    madvise(log->map, log->mapsize, MADV_WILLNEED);
+
+    hdr = log->map;
+    if (memcmp(hdr->magic, OPLOG_MAGIC, sizeof(OPLOG_MAGIC)) != 0 ||
+        hdr->version != OPLOG_VERSION ||
+        hdr->record_size != sizeof(struct op_record)) {
+        fprintf(stderr, "%s is not a compiled op stream (version %d)\n",
+                path, OPLOG_VERSION);
+        goto bad;
+    }
+    if (hdr->records_off % sizeof(uint64_t) != 0 ||
+        hdr->records_off > log->mapsize ||
+        hdr->nrecords > (log->mapsize - hdr->records_off) / sizeof(struct op_record) ||
+        hdr->strtab_off % sizeof(uint32_t) != 0 ||
+        hdr->strtab_off > log->mapsize ||
+        (uint64_t)hdr->nstrings * sizeof(uint32_t) + hdr->strtab_size >
+            log->mapsize - hdr->strtab_off) {
+        fprintf(stderr, "%s is truncated or corrupted\n", path);
+        goto bad;
+    }
+
+    const uint32_t *offsets = (const uint32_t *)((char *)log->map + hdr->strtab_off);
+    const char *blob = (const char *)(offsets + hdr->nstrings);
+    log->nstrings = hdr->nstrings;
+    log->strings = calloc(log->nstrings ? log->nstrings : 1, sizeof(char *));
+    assert(log->strings);
+    for (uint32_t i = 0; i < log->nstrings; ++i) {
+        if (offsets[i] >= hdr->strtab_size ||
+            memchr(blob + offsets[i], '\0', hdr->strtab_size - offsets[i]) == NULL) {
+            fprintf(stderr, "%s: bad string table entry %u\n", path, i);
+            goto bad;
+        }
+        log->strings[i] = blob + offsets[i];
+    }
+
+    log->path_ids = malloc((log->nstrings ? log->nstrings : 1) * sizeof(int));
+    assert(log->path_ids);
+    for (uint32_t i = 0; i < log->nstrings; ++i)
+        log->path_ids[i] = -1;
+
+    /* Validate records and intern every string used as a path */
+    log->records = (const struct op_record *)((char *)log->map + hdr->records_off);
+    log->nrecords = hdr->nrecords;
+    for (uint64_t i = 0; i < log->nrecords; ++i) {
+        const struct op_record *rec = &log->records[i];
+        if (rec->opcode >= OP_MAX || rec->path >= log->nstrings ||
+            (rec->path2 != OPLOG_NOSTR && rec->path2 >= log->nstrings) ||
+            (rec->value != OPLOG_NOSTR && rec->value >= log->nstrings)) {
+            fprintf(stderr, "%s: bad record %lu\n", path, (unsigned long)i);
+            goto bad;
+        }
+        if (log->path_ids[rec->path] < 0)
+            log->path_ids[rec->path] = path_intern(log->strings[rec->path]);
+        if ((rec->opcode == OP_LINK || rec->opcode == OP_SYMLINK) &&
+            rec->path2 != OPLOG_NOSTR && log->path_ids[rec->path2] < 0)
+            log->path_ids[rec->path2] = path_intern(log->strings[rec->path2]);
+    }
+    return 0;
+
+bad:
+    oplog_close(log);
+    return -1;
+}
+
+void oplog_close(struct oplog *log)
+{
+    if (log->map)
+        munmap(log->map, log->mapsize);
+    free(log->strings);
+    free(log->path_ids);
+    memset(log, 0, sizeof(*log));
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Path interning and directory fd cache.
+ *
+ * The sequence log only touches a handful of distinct paths, so each of
+ * them is interned once and remembers its parent directory and last
+ * component. Handlers then issue *at() syscalls relative to a cached fd of
+ * the parent directory, which saves the kernel from walking the full
+ * absolute path on every op.
+ *
+ * A cached fd pins the directory it was opened on, so it has to be
+ * dropped whenever that directory may stop being the one the path refers
+ * to (rmdir, unlink of a symlink) and before every unmount, since open fds
+ * would keep the file system busy.
+ */
+#include "replay.h"
+
+struct path_entry {
+    const char *path;       /* full path, owned by the strtab */
+    const char *name;       /* last component, points into path */
+    int parent;             /* id of the parent directory, or -1 */
+    int dirfd;              /* cached fd of this path as a directory, or -1 */
+};
+
+static struct strtab path_tab;
+static struct strtab str_tab;     /* other strings, e.g. xattr names */
+static bool cache_enabled = true;
+static struct path_entry *entries;
+static int nentries;
+static int entries_cap;
+
+int path_intern(const char *path)
+{
+    return path_intern_len(path, strlen(path));
+}
+
+/* Intern the path of @len bytes at @path, which need not be NUL-terminated */
+int path_intern_len(const char *path, size_t len)
+{
+    if (path_tab.strs == NULL)
+        strtab_init(&path_tab);
+
+    int id = strtab_intern_len(&path_tab, path, len);
+    if (id < nentries)
+        return id;
+
+    /* A new path: record it before interning its parent, which may grow
+     * the entry array */
+    if (nentries == entries_cap) {
+        entries_cap = entries_cap ? entries_cap * 2 : 64;
+        entries = realloc(entries, entries_cap * sizeof(*entries));
+        assert(entries);
+    }
+    assert(id == nentries);
+    nentries++;
+
+    const char *fullpath = path_tab.strs[id];
+    const char *slash = strrchr(fullpath, '/');
+    entries[id].path = fullpath;
+    entries[id].dirfd = -1;
+    entries[id].parent = -1;
+    entries[id].name = fullpath;
+    if (slash && slash[1] != '\0') {
+        size_t plen = slash - fullpath;
+        char parent[PATH_MAX];
+        if (plen == 0)
+            plen = 1;   /* parent of "/x" is "/" */
+        if (plen < sizeof(parent)) {
+            memcpy(parent, fullpath, plen);
+            parent[plen] = '\0';
+            int pid = path_intern(parent);
+            entries[id].parent = pid;
+            entries[id].name = slash + 1;
+        }
+    }
+    return id;
+}
+
+const char *path_str(int id)
+{
+    return entries[id].path;
+}
+
+/*
+ * Move every interned path under @from to the same place under @to, e.g.
+ * to replay the sequence on another mount point. Ops keep their path ids;
+ * their strings have to be fetched again with path_str().
+ */
+void path_rebase(const char *from, const char *to)
+{
+    size_t flen = strlen(from), tlen = strlen(to);
+
+    for (int id = 0; id < nentries; ++id) {
+        const char *path = entries[id].path;
+        if (strncmp(path, from, flen) != 0 || (path[flen] != '\0' && path[flen] != '/'))
+            continue;
+        size_t rlen = strlen(path + flen);
+        char *rebased = malloc(tlen + rlen + 1);
+        assert(rebased);
+        memcpy(rebased, to, tlen);
+        memcpy(rebased + tlen, path + flen, rlen + 1);
+        entries[id].name = rebased + tlen + rlen - strlen(entries[id].name);
+        entries[id].path = rebased;
+    }
+}
+
+/* Id of the parent directory of @id, or -1 */
+int path_parent(int id)
+{
+    return entries[id].parent;
+}
+
+int path_count()
+{
+    return nentries;
+}
+
+/* Intern a string that is not a path, returning a stable copy */
+const char *str_intern(const char *s)
+{
+    return str_intern_len(s, strlen(s));
+}
+
+const char *str_intern_len(const char *s, size_t len)
+{
+    if (str_tab.strs == NULL)
+        strtab_init(&str_tab);
+    return str_tab.strs[strtab_intern_len(&str_tab, s, len)];
+}
+
+/*
+ * Resolve @id into a (dirfd, name) pair for the *at() syscalls. Falls back
+ * to (AT_FDCWD, full path) if the parent directory cannot be opened, so
+ * the op fails with the same errno it would have without the cache.
+ */
+void path_at(int id, int *dirfd, const char **name)
+{
+    struct path_entry *ent = &entries[id];
+
+    *dirfd = AT_FDCWD;
+    *name = ent->path;
+    if (ent->parent < 0 || !cache_enabled)
+        return;
+
+    struct path_entry *parent = &entries[ent->parent];
+    if (parent->dirfd < 0) {
+        int err = errno;
+        parent->dirfd = open(parent->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (parent->dirfd < 0) {
+            errno = err;
+            return;
+        }
+    }
+    *dirfd = parent->dirfd;
+    *name = ent->name;
+}
+
+/* Drop the cached fd of @id, e.g. after it was removed */
+void path_invalidate(int id)
+{
+    if (entries[id].dirfd >= 0) {
+        close(entries[id].dirfd);
+        entries[id].dirfd = -1;
+    }
+}
+
+void path_invalidate_all()
+{
+    for (int i = 0; i < nentries; ++i)
+        path_invalidate(i);
+}
+
+/* Resolve every path from the root from now on, e.g. when ops of several
+ * threads could race on the cache */
+void path_cache_disable()
+{
+    path_invalidate_all();
+    cache_enabled = false;
+}
@@ -8,30 +8,15 @@
  * You can redistribute it and/or modify it under the terms of the Apache
  * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
  */
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdbool.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <assert.h>
-#include <sys/stat.h>
-#include <sys/mount.h>
-#include <sys/types.h>
-#include <sys/xattr.h>
-#include <limits.h>
-
-/* Max length of function name in log */
-#define FUNC_NAME_LEN    16
-#define DEFAULT_INITCAP 16
-
-#ifndef PATH_MAX
-#define PATH_MAX    4096
-#endif
+#include "replay.h"
+#include <sys/resource.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/uio.h>
 
 int pre = 0;
 int seq = 0;
+unsigned long iteration = 0;
 unsigned int n_fs = 1;
 char *fsys = "jfs";
 char *fssuffix = "-i0-s0";
@@ -45,210 +30,115 @@ char *basepath = "/mnt/test-jfs-i0-s0";
  */
 char *device = "/dev/ram0";
 
-struct vector {
-    unsigned char *data;
-    size_t unitsize;
-    size_t len;
-    size_t capacity;
+/* How mountall() mounts: mount(2), or the fsopen() family of syscalls */
+enum mount_api {
+    MOUNT_API_LEGACY,
+    MOUNT_API_FSOPEN,
 };
 
-typedef struct vector vector_t;
-
-static inline void _vector_init(struct vector *vec, size_t unitsize, size_t initcap) {
-    if (initcap < DEFAULT_INITCAP)
-        initcap = DEFAULT_INITCAP;
-    vec->unitsize = unitsize;
-    vec->len = 0;
-    vec->capacity = initcap;
-    vec->data = (unsigned char *)calloc(initcap, unitsize);
-}
-#define vector_init_2(vec, type)    _vector_init(vec, sizeof(type), DEFAULT_INITCAP)
-#define vector_init_3(vec, type, initcap)   _vector_init(vec, sizeof(type), initcap)
-#define vector_init_x(a, b, c, func, ...)   func
-/* Macro function with optional arg: vector_init(struct vector *vec, type, [initcap=16]) */
-#define vector_init(...)    vector_init_x(__VA_ARGS__,\
-                                          vector_init_3(__VA_ARGS__),\
-                                          vector_init_2(__VA_ARGS__)\
-                                         )
-
-static inline int vector_expand(struct vector *vec) {
-    size_t newcap = vec->unitsize * vec->capacity * 2;
-    unsigned char *newptr = (unsigned char *)realloc(vec->data, newcap);
-    if (newptr == NULL)
-        return ENOMEM;
-    vec->data = newptr;
-    vec->capacity *= 2;
-    return 0;
-}
-
-static inline int vector_add(struct vector *vec, void *el) {
-    int ret;
-    if (vec->len >= vec->capacity) {
-        if ((ret = vector_expand(vec)) != 0)
-            return ret;
-    }
-    size_t offset = vec->len * vec->unitsize;
-    memcpy(vec->data + offset, el, vec->unitsize);
-    vec->len++;
-    return 0;
-}
-
-static inline void *_vector_get(struct vector *vec, size_t index) {
-    if (index < 0 || index >= vec->len)
-        return NULL;
-    return (void *)(vec->data + index * vec->unitsize);
-}
+static enum mount_api mount_api = MOUNT_API_LEGACY;
 
-#define vector_get(vec, type, index) \
-    (type *)_vector_get(vec, index)
+enum mount_policy mount_policy = MOUNT_PER_OP;
+unsigned long mount_every = 1;
 
-static inline void *_vector_peek_top(struct vector *vec) {
-    if (vec->len == 0)
-        return NULL;
-    return (void *)(vec->data + (vec->len - 1) * vec->unitsize);
-}
-
-#define vector_peek_top(vec, type) \
-    (type *)_vector_peek_top(vec)
+/* How ops are issued to the kernel */
+enum backend {
+    BACKEND_SYNC,       /* one blocking syscall at a time */
+    BACKEND_URING,      /* batched through io_uring, see uring.c */
+    BACKEND_KERNEL,     /* executed by the kmod/ module, see kernel.c */
+};
 
-static inline void vector_destroy(struct vector *vec) {
-    free(vec->data);
-    memset(vec, 0, sizeof(struct vector));
-}
+enum backend backend = BACKEND_SYNC;
+int uring_depth = 64;
+bool uring_relaxed = false;
 
-#define vector_iter(vec, type, entry) \
-    int _i; \
-    for (entry = (type *)((vec)->data), _i = 0; _i < (vec)->len; ++_i, ++entry)
+/* Race amplification with worker threads, see workers.c */
+int nthreads = 0;
+enum shard_mode shard_mode = SHARD_PATH;
+unsigned long barrier_every = 0;
 
 extern char func[FUNC_NAME_LEN + 1];
 
-#define min(x, y) ((x >= y) ? y : x)
-
-enum fill_type {PATTERN, ONES, BYTE_REPEAT, RANDOM_EACH_BYTE};
+void unmount_all(bool strict);
 
-void extract_fields(vector_t *fields_vec, char *line, const char *delim)
+static inline void unmount_all_strict()
 {
-    vector_init(fields_vec, char *);
-    char *field = strtok(line, delim);
-    while (field) {
-        size_t flen = strlen(field);
-        char *field_copy = malloc(flen + 1);
-        assert(field_copy);
-        field_copy[flen] = '\0';
-        strncpy(field_copy, field, flen);
-        vector_add(fields_vec, &field_copy);
-        field = strtok(NULL, ", ");
-    }
+    unmount_all(true);
 }
 
-void destroy_fields(vector_t *fields_vec)
+static inline void unmount_all_relaxed()
 {
-    char **field;
-    vector_iter(fields_vec, char *, field) {
-        free(*field);
-    }
-    vector_destroy(fields_vec);
+    unmount_all(false);
 }
 
-/* Generate data into a given buffer.
- * @value: 0-255 for uniform characters, -1 for random filling */
-static inline void generate_data(char *buffer, size_t len, size_t offset, enum fill_type type, int value)
+int create_file(int id, int flags, int mode)
 {
-    switch (type) {
-    /* ONES: write all byte 1 */
-    case ONES:
-        memset(buffer, 1, len);
-        break;
-    /* BYTE_REPEAT: select a random byte but write this byte uniformly */
-    case BYTE_REPEAT:
-        memset(buffer, value, len);
-        break;
-    /* PATTERN: write the bytes that are the same as the value of offsets */
-    case PATTERN:
-    {
-        int new_offset = 3 - offset % sizeof(int);
-        for (int i = 0; i < new_offset; i++) {
-            buffer[i] = 0;
-        }
-        int *ip = (int *) (buffer + new_offset);
-        for (int i = 0; i <= len / sizeof(int); i++) {
-            ip[i] = offset / sizeof(int) + i;
-        }
-        break;
-    }
-    /* RANDOM_EACH_BYTE: write random value for each int size (4 bytes) */
-    case RANDOM_EACH_BYTE:
-    {
-        size_t i = 0, remaining = len;
-        int n = rand();
-        while (remaining > 0) {
-            int *ptr = (int *)(buffer + i);
-            *ptr = n;
-            remaining -= min(sizeof(int), remaining);
-            i += min(sizeof(int), remaining);
-        }
-        break;
-    }
+    int fd = fd_open(id, flags, mode);
+    if (fd >= 0) {
+        fd_close(fd);
     }
+    return (fd >= 0) ? 0 : -1;
 }
 
-static inline ssize_t fsize(int fd)
-{
-    struct stat info;
-    int ret = fstat(fd, &info);
-    if (ret != 0)
-        return -1;
-    if (info.st_mode & S_IFREG) {
-        // verify st_size is even multiple of 4096
-        const size_t bs = 4096;
-        if (info.st_size % bs != 0)
-            return -1;
-        return info.st_size;
-    } else if (info.st_mode & S_IFBLK) {
-        size_t devsz;
-        ret = ioctl(fd, BLKGETSIZE64, &devsz);
-        if (ret == -1)
-            return -1;
-        return devsz;
-    } else {
-        return -1;
-    }
-}
+/* How write_file() issues the write, see --write-mode */
+int write_mode = 0;
 
-void unmount_all(bool strict);
+/* Writes issued with O_DIRECT, and those too unaligned for it */
+static struct {
+    uint64_t direct;
+    uint64_t unaligned;
+} write_stats;
 
-static inline void unmount_all_strict()
+/*
+ * Open flags for a write of @length bytes at @offset. O_DIRECT is only
+ * added if the write is block aligned, otherwise the write goes through
+ * the page cache as usual. The data always comes from an aligned buffer.
+ */
+int write_open_flags(int flags, off_t offset, size_t length)
 {
-    unmount_all(true);
+    if (!(write_mode & WRITE_DIRECT))
+        return flags;
+    if (offset % DIRECT_ALIGN != 0 || length % DIRECT_ALIGN != 0) {
+        __atomic_add_fetch(&write_stats.unaligned, 1, __ATOMIC_RELAXED);
+        return flags;
+    }
+    __atomic_add_fetch(&write_stats.direct, 1, __ATOMIC_RELAXED);
+    return flags | O_DIRECT;
 }
 
-static inline void unmount_all_relaxed()
+/* Per-write flags for pwritev2() */
+int write_rw_flags()
 {
-    unmount_all(false);
-}
+    int rwf = 0;
 
-int create_file(const char *path, int flags, int mode)
-{
-    int fd = open(path, flags, mode);
-    if (fd >= 0) {
-        close(fd);
-    }
-    return (fd >= 0) ? 0 : -1;
+    if (write_mode & WRITE_DSYNC)
+        rwf |= RWF_DSYNC;
+    if (write_mode & WRITE_NOWAIT)
+        rwf |= RWF_NOWAIT;
+    return rwf;
 }
 
-ssize_t write_file(const char *path, int flags, void *data, off_t offset, size_t length)
+ssize_t write_file(int id, int flags, void *data, off_t offset, size_t length)
 {
-    int fd = open(path, flags, O_RDWR);
+    int fd = fd_open(id, write_open_flags(flags, offset, length), O_RDWR);
     int err;
+    ssize_t writesz;
     if (fd < 0) {
         return -1;
     }
-    off_t res = lseek(fd, offset, SEEK_SET);
-    if (res == (off_t) -1) {
-        err = errno;
-        goto exit_err;
+    if (write_mode & (WRITE_DSYNC | WRITE_NOWAIT)) {
+        struct iovec iov = {.iov_base = data, .iov_len = length};
+        writesz = pwritev2(fd, &iov, 1, offset, write_rw_flags());
+    } else if (write_mode & WRITE_PWRITE) {
+        writesz = pwrite(fd, data, length, offset);
+    } else {
+        off_t res = lseek(fd, offset, SEEK_SET);
+        if (res == (off_t) -1) {
+            err = errno;
+            goto exit_err;
+        }
+        writesz = write(fd, data, length);
     }
-    ssize_t writesz = write(fd, data, length);
     if (writesz < 0) {
         err = errno;
         goto exit_err;
@@ -257,210 +147,381 @@ ssize_t write_file(const char *path, int flags, void *data, off_t offset, size_t
         fprintf(stderr, "Note: less data written than expected (%ld < %zu)\n",
                 writesz, length);
     }
-    close(fd);
+    fd_close(fd);
     return writesz;
 
 exit_err:
-    close(fd);
+    fd_close(fd);
     errno = err;
     return -1;
 }
 
-int do_create_file(vector_t *argvec)
+/* The op as it appears in the replay output, e.g. "mkdir(/mnt/x, 0755)" */
+int format_op(char *buf, size_t size, const struct replay_op *op)
 {
-    char *filepath = *vector_get(argvec, char *, 1);
-    char *flagstr = *vector_get(argvec, char *, 2);
-    char *modestr = *vector_get(argvec, char *, 3);
-    char *endptr;
-    int flags = (int)strtol(flagstr, &endptr, 8);
-    int mode = (int)strtol(modestr, &endptr, 8);
-    int res = create_file(filepath, flags, mode);
-    printf("create_file(%s, 0%o, 0%o) -> ret=%d, errno=%s\n",
-            filepath, flags, mode, res, strerror(errno));
-    return res;
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        return snprintf(buf, size, "create_file(%s, 0%o, 0%o)",
+                        op->path, op->flags, op->mode);
+    case OP_WRITE_FILE:
+        return snprintf(buf, size, "write_file(%s, %o, %ld, %lu)",
+                        op->path, op->flags, op->offset, op->length);
+    case OP_TRUNCATE:
+        return snprintf(buf, size, "truncate(%s, %ld)", op->path, (off_t)op->length);
+    case OP_UNLINK:
+        return snprintf(buf, size, "unlink(%s)", op->path);
+    case OP_SYMLINK:
+        return snprintf(buf, size, "symlink(%s, %s)", op->path, op->path2);
+    case OP_LINK:
+        return snprintf(buf, size, "link(%s, %s)", op->path, op->path2);
+    case OP_MKDIR:
+        return snprintf(buf, size, "mkdir(%s, 0%o)", op->path, op->mode);
+    case OP_RMDIR:
+        return snprintf(buf, size, "rmdir(%s)", op->path);
+    case OP_SETXATTR:
+        return snprintf(buf, size, "setxattr(%s, %s, %s, %zu, %d)",
+                        op->path, op->path2, op->value, op->length, op->flags);
+    case OP_REMOVEXATTR:
+        return snprintf(buf, size, "removexattr(%s, %s)", op->path, op->path2);
+    case OP_CHOWN:
+        return snprintf(buf, size, "chown(%s, %d)", op->path, (int)op->mode);
+    case OP_CHGRP:
+        return snprintf(buf, size, "chgrp(%s, %d)", op->path, (int)op->mode);
+    case OP_CHMOD:
+        return snprintf(buf, size, "chmod(%s, 0%o)", op->path, op->mode);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Print the result of an op. This is shared by all backends so that the
+ * replay output looks the same regardless of how the op was issued.
+ */
+void report_op(const struct replay_op *op, int ret, int err)
+{
+    /* run_op() hands it to the trace, the model and the other file systems */
+    trace_ret = ret;
+    trace_err = err;
+    if (tracing)
+        return;
+    /* Worker threads print the seq with the result so that the two lines
+     * are not interleaved with those of other workers */
+    if (worker_seq >= 0) {
+        flockfile(stdout);
+        printf("seq=%d \n", worker_seq);
+    }
+    char call[3 * PATH_MAX];
+    if (format_op(call, sizeof(call), op) < 0)
+        printf("Unrecognized op: %d\n", op->opcode);
+    else
+        printf("%s -> ret=%d, errno=%s\n", call, ret, strerror(err));
+    if (worker_seq >= 0)
+        funlockfile(stdout);
 }
 
-int do_write_file(vector_t *argvec, int seq)
+int do_create_file(const struct replay_op *op, int seq)
 {
-    char *filepath = *vector_get(argvec, char *, 1);
-    char *flagstr = *vector_get(argvec, char *, 2);
-    char *offset_str = *vector_get(argvec, char *, 4);
-    char *len_str = *vector_get(argvec, char *, 5);
-    char *endp;
-    int flags = (int)strtol(flagstr, &endp, 8);
-    off_t offset = strtol(offset_str, &endp, 10);
-    size_t writelen = strtoul(len_str, &endp, 10);
-    assert(offset != LONG_MAX);
-    assert(writelen != ULONG_MAX);
+    int res = create_file(op->path_id, op->flags, op->mode);
+    report_op(op, res, errno);
+    return res;
+}
 
-    char *buffer = malloc(writelen);
-    assert(buffer != NULL);
+/* Fill @buffer with the data that write_file op number @seq writes */
+void fill_write_data(char *buffer, const struct replay_op *op, int seq)
+{
     /* This is to make sure data written to all file systems in the same
         * group of operations is the same */
     int integer_to_write = seq / n_fs;
-    generate_data(buffer, writelen, offset, BYTE_REPEAT, integer_to_write);
-    int ret = write_file(filepath, flags, buffer, offset, writelen);
+    generate_data(buffer, op->length, op->offset, BYTE_REPEAT, integer_to_write);
+}
+
+int do_write_file(const struct replay_op *op, int seq)
+{
+    char *buffer = write_arena(op->length);
+    fill_write_data(buffer, op, seq);
+    int ret = write_file(op->path_id, op->flags, buffer, op->offset, op->length);
     int err = errno;
-    printf("write_file(%s, %o, %ld, %lu) -> ret=%d, errno=%s\n",
-            filepath, flags, offset, writelen, ret, strerror(err));
-    free(buffer);
+    report_op(op, ret, err);
     return ret;
 }
 
-int do_truncate(vector_t *argvec)
+int do_truncate(const struct replay_op *op, int seq)
 {
-	char *filepath = *vector_get(argvec, char *, 1);
-	char *len_str = *vector_get(argvec, char *, 2);
-	off_t flen = atol(len_str);
-	
-	int ret = truncate(filepath, flen);
-	int err = errno;
-	printf("truncate(%s, %ld) -> ret=%d, errno=%s\n",
-	       filepath, flen, ret, strerror(err));
+	off_t flen = op->length;
+	int ret, err;
+
+	/* Truncate through a cached fd if the file is already open for
+	 * writing */
+	int fd = fd_writable(op->path_id);
+	if (fd >= 0)
+		ret = ftruncate(fd, flen);
+	else
+		ret = truncate(op->path, flen);
+	err = errno;
+	report_op(op, ret, err);
 	return ret;
 }
 
-int do_unlink(vector_t *argvec)
+int do_unlink(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    int ret = unlink(path);
+    int dirfd;
+    const char *name;
+    path_at(op->path_id, &dirfd, &name);
+    int ret = unlinkat(dirfd, name, 0);
     int err = errno;
-    printf("unlink(%s) -> ret=%d, errno=%s\n",
-            path, ret, strerror(err));
+    /* The path may have been a symlink we cached as a directory, and
+     * cached files may have been opened through it */
+    if (ret == 0) {
+        path_invalidate(op->path_id);
+        fd_invalidate_all();
+    }
+    report_op(op, ret, err);
     return ret;
 }
 
-int do_symlink(vector_t *argvec)
+int do_symlink(const struct replay_op *op, int seq)
 {
-	char *srcpath = *vector_get(argvec, char *, 1);
-	char *dstpath = *vector_get(argvec, char *, 2);
-
-	int ret = symlink(srcpath, dstpath);
+	int dirfd;
+	const char *name;
+	path_at(op->path2_id, &dirfd, &name);
+	int ret = symlinkat(op->path, dirfd, name);
 	int err = errno;
-	printf("symlink(%s, %s) -> ret=%d, errno=%s\n",
-	       srcpath, dstpath, ret, strerror(err));
+	report_op(op, ret, err);
 	return ret;
 }
 
-int do_link(vector_t *argvec)
+int do_link(const struct replay_op *op, int seq)
 {
-	char *srcpath = *vector_get(argvec, char *, 1);
-	char *dstpath = *vector_get(argvec, char *, 2);
-
-	int ret = link(srcpath, dstpath);
+	int olddirfd, newdirfd;
+	const char *oldname, *newname;
+	path_at(op->path_id, &olddirfd, &oldname);
+	path_at(op->path2_id, &newdirfd, &newname);
+	int ret = linkat(olddirfd, oldname, newdirfd, newname, 0);
 	int err = errno;
-	printf("link(%s, %s) -> ret=%d, errno=%s\n",
-	       srcpath, dstpath, ret, strerror(err));
+	report_op(op, ret, err);
 	return ret;
 }
 
-int do_mkdir(vector_t *argvec)
+int do_mkdir(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    char *modestr = *vector_get(argvec, char *, 2);
-    char *endp;
-    int mode = (int)strtol(modestr, &endp, 8);
-    int ret = mkdir(path, mode);
+    int dirfd;
+    const char *name;
+    path_at(op->path_id, &dirfd, &name);
+    int ret = mkdirat(dirfd, name, op->mode);
     int err = errno;
-    printf("mkdir(%s, 0%o) -> ret=%d, errno=%s\n",
-            path, mode, ret, strerror(err));
+    report_op(op, ret, err);
     return ret;
 }
 
-int do_rmdir(vector_t *argvec)
+int do_rmdir(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    int ret = rmdir(path);
+    int dirfd;
+    const char *name;
+    path_at(op->path_id, &dirfd, &name);
+    int ret = unlinkat(dirfd, name, AT_REMOVEDIR);
     int err = errno;
-    printf("rmdir(%s) -> ret=%d, errno=%s\n",
-            path, ret, strerror(err));
+    /* Cached fds may refer to the removed directory, directly or through
+     * a symlink, so drop all of them */
+    if (ret == 0) {
+        path_invalidate_all();
+        fd_invalidate_all();
+    }
+    report_op(op, ret, err);
     return ret;
 }
 
-int do_setxattr(vector_t *argvec)
+int do_setxattr(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    char *attr_name = *vector_get(argvec, char *, 2);
-    char *attr_value = *vector_get(argvec, char *, 3);
-    char *size = *vector_get(argvec, char *, 4);
-    char *flag = *vector_get(argvec, char *, 5);
+    int ret = setxattr(op->path, op->path2, op->value, op->length, op->flags);
+    int err = errno;
 
-    char *size_ptr, *flag_ptr;
-    size_t attr_size = strtoul(size, &size_ptr, 10);
-    int flag_val = (int) strtol(flag, &flag_ptr, 0);
+    report_op(op, ret, err);
+
+    return ret;
+}
 
-    int ret = setxattr(path, attr_name, attr_value, attr_size, flag_val);
+int do_removexattr(const struct replay_op *op, int seq)
+{
+    int ret = removexattr(op->path, op->path2);
     int err = errno;
 
-    printf("setxattr(%s, %s, %s, %zu, %d) -> ret=%d, errno=%s\n",
-            path, attr_name, attr_value, attr_size, flag_val, ret, strerror(err));
-    
+    report_op(op, ret, err);
+
     return ret;
 }
 
-int do_removexattr(vector_t *argvec)
+int do_chown(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    char *attr_name = *vector_get(argvec, char *, 2);
+    uid_t uid = op->mode;
 
-    int ret = removexattr(path, attr_name);
+    int dirfd;
+    const char *name;
+    path_at(op->path_id, &dirfd, &name);
+    int ret = fchownat(dirfd, name, uid, -1, 0);
     int err = errno;
 
-    printf("removexattr(%s, %s) -> ret=%d, errno=%s\n",
-            path, attr_name, ret, strerror(err));
-    
-    return ret;   
+    report_op(op, ret, err);
+
+    return ret;
 }
 
-int do_chown(vector_t *argvec)
+int do_chgrp(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    char *owner_name = *vector_get(argvec, char *, 2);
+    gid_t gid = op->mode;
 
-    char *owner_str;
-    uid_t uid = strtoul(owner_name, &owner_str, 10);
-
-    int ret = chown(path, uid, -1);
+    int dirfd;
+    const char *name;
+    path_at(op->path_id, &dirfd, &name);
+    int ret = fchownat(dirfd, name, -1, gid, 0);
     int err = errno;
 
-    printf("chown(%s, %d) -> ret=%d, errno=%s\n",
-            path, (int) uid, ret, strerror(err));
-    
+    report_op(op, ret, err);
+
     return ret;
 }
 
-int do_chgrp(vector_t *argvec)
+int do_chmod(const struct replay_op *op, int seq)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    char *group_name = *vector_get(argvec, char *, 2);
+    int dirfd;
+    const char *name;
+    path_at(op->path_id, &dirfd, &name);
+    int ret = fchmodat(dirfd, name, op->mode, 0);
+    int err = errno;
 
-    char *group_str;
-    gid_t gid = strtoul(group_name, &group_str, 10);
+    report_op(op, ret, err);
 
-    int ret = chown(path, -1, gid);
-    int err = errno;
+    return ret;
+}
+
+/* Handlers indexed by enum op_code */
+static const op_handler_t op_handlers[OP_MAX] = {
+    [OP_CREATE_FILE] = do_create_file,
+    [OP_WRITE_FILE] = do_write_file,
+    [OP_TRUNCATE] = do_truncate,
+    [OP_MKDIR] = do_mkdir,
+    [OP_RMDIR] = do_rmdir,
+    [OP_SYMLINK] = do_symlink,
+    [OP_LINK] = do_link,
+    [OP_UNLINK] = do_unlink,
+    [OP_CHMOD] = do_chmod,
+    [OP_CHGRP] = do_chgrp,
+    [OP_CHOWN] = do_chown,
+    [OP_REMOVEXATTR] = do_removexattr,
+    [OP_SETXATTR] = do_setxattr,
+};
+
+/* Per-opcode dispatch counters; the OP_MAX slot counts unrecognized ops */
+struct op_stats op_stats[OP_MAX + 1];
+struct latency_hist op_latency[LAT_MAX];
+
+/* Unmounts that found the file system busy, in the current iteration */
+static struct {
+    uint64_t busy;          /* unmounts that got EBUSY at least once */
+    uint64_t busy_ns;       /* time from the first EBUSY until unmounted */
+    uint64_t lazy;          /* unmounts that were detached instead */
+} unmount_stats;
 
-    printf("chgrp(%s, %d) -> ret=%d, errno=%s\n",
-            path, (int) gid, ret, strerror(err));
-    
-    return ret;   
+/* Execute a decoded op against the mounted file system */
+int run_op(const struct replay_op *op, int seq)
+{
+    struct op_stats *st = &op_stats[op->opcode];
+    uint64_t start = now_ns();
+    int ret = op_handlers[op->opcode](op, seq);
+    uint64_t ns = now_ns() - start;
+    if (tracing)
+        trace_op(seq, op->opcode, trace_ret, trace_err, ns);
+    if (verifying)
+        model_check(op, seq, trace_ret, trace_err);
+    if (state_hashing)
+        state_hash_op(op, seq);
+    if (lockstep_fs > 0)
+        lockstep_op(op, seq, trace_ret, trace_err);
+    /* Atomic since worker threads share the counters */
+    __atomic_fetch_add(&st->ns, ns, __ATOMIC_RELAXED);
+    hist_record(&op_latency[op->opcode], ns);
+    __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+    if (ret < 0)
+        __atomic_fetch_add(&st->failed, 1, __ATOMIC_RELAXED);
+    return ret;
 }
 
-int do_chmod(vector_t *argvec)
+/* Upper bound of the values counted in bucket @b */
+static uint64_t hist_value(unsigned int b)
 {
-    char *path = *vector_get(argvec, char *, 1);
-    char *mode_val = *vector_get(argvec, char *, 2);
+    if (b < 2 * HIST_SUB)
+        return b;
+    int shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
 
-    char *mode_str;
-    mode_t mode = strtol(mode_val, &mode_str, 8);
+/* Smallest value that at least @q of the @count values are below */
+static uint64_t hist_percentile(const struct latency_hist *h, uint64_t count,
+                                double q)
+{
+    uint64_t target = (uint64_t)(q * count + 0.5), seen = 0;
+
+    if (target == 0)
+        target = 1;
+    for (unsigned int b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= target)
+            return min(hist_value(b), h->max);
+    }
+    return h->max;
+}
 
-    int ret = chmod(path, mode);
-    int err = errno;
+static void print_latency(const char *name, const struct latency_hist *h)
+{
+    uint64_t count = 0;
+
+    for (unsigned int b = 0; b < HIST_BUCKETS; ++b)
+        count += h->buckets[b];
+    if (count == 0)
+        return;
+    printf("%-12s %10lu %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long)count, hist_percentile(h, count, 0.5) / 1e3,
+           hist_percentile(h, count, 0.99) / 1e3,
+           hist_percentile(h, count, 0.999) / 1e3, h->max / 1e3);
+}
 
-    printf("chmod(%s, 0%o) -> ret=%d, errno=%s\n",
-            path, mode, ret, strerror(err));
-    
-    return ret;
+/* Latency percentiles of the ops, mounts and unmounts, in microseconds */
+void print_latency_stats()
+{
+    printf("%-12s %10s %10s %10s %10s %10s\n", "latency(us)", "count",
+           "p50", "p99", "p999", "max");
+    for (int i = 0; i < OP_MAX; ++i)
+        print_latency(op_names[i], &op_latency[i]);
+    print_latency("mount", &op_latency[LAT_MOUNT]);
+    print_latency("unmount", &op_latency[LAT_UNMOUNT]);
+    if (unmount_stats.busy > 0)
+        printf("busy unmounts: %lu, %.3f ms waiting, %lu detached\n",
+               (unsigned long)unmount_stats.busy, unmount_stats.busy_ns / 1e6,
+               (unsigned long)unmount_stats.lazy);
+    print_fd_cache_stats();
+    if (write_mode & WRITE_DIRECT)
+        printf("direct writes: %lu, %lu buffered (unaligned)\n",
+               (unsigned long)write_stats.direct,
+               (unsigned long)write_stats.unaligned);
+}
+
+void print_op_stats()
+{
+    uint64_t total = 0;
+
+    printf("%-12s %10s %10s %12s\n", "op", "count", "failed", "avg(ns)");
+    for (int i = 0; i < OP_MAX; ++i) {
+        struct op_stats *st = &op_stats[i];
+        total += st->count;
+        if (st->count == 0)
+            continue;
+        printf("%-12s %10lu %10lu %12lu\n", op_names[i],
+               (unsigned long)st->count, (unsigned long)st->failed,
+               (unsigned long)(st->ns / st->count));
+    }
+    printf("%-12s %10lu\n", "unrecognized",
+           (unsigned long)op_stats[OP_MAX].count);
+    printf("%-12s %10lu\n", "total", (unsigned long)total);
 }
 
 void mountall()
@@ -468,12 +529,17 @@ void mountall()
     int failpos, err;
 
     int ret = -1;
-    ret = mount(device, basepath, fsys, MS_NOATIME, "");
+    uint64_t start = now_ns();
+    if (mount_api == MOUNT_API_FSOPEN)
+        ret = fsm_mount();
+    else
+        ret = mount(device, basepath, fsys, MS_NOATIME, "");
     if (ret != 0) {
         // failpos = i;
         err = errno;
         goto err;
     }
+    hist_record(&op_latency[LAT_MOUNT], now_ns() - start);
 
     return;
 err:
@@ -487,51 +553,293 @@ err:
     exit(1);
 }
 
+static bool lazy_unmount = false;
+
+/* Give up on a busy file system after this long */
+#define UNMOUNT_TIMEOUT_NS  (60 * 1000000000ull)
+/* Tries that only yield the CPU before waiting on the mount table */
+#define UNMOUNT_SPIN_TRIES  16
+
+/*
+ * Wait before unmount try @tries + 1. A file system is usually busy only
+ * for a moment (a kworker finishing up), so the first tries just yield.
+ * After that, wait for the mount table to change, which is what happens
+ * when whatever held the file system lets go of its mounts, with a
+ * timeout that doubles up to 100ms in case nothing in the mount table
+ * changes.
+ */
+static void unmount_wait(int tries)
+{
+    static int mountinfo = -1;
+
+    if (tries <= UNMOUNT_SPIN_TRIES) {
+        sched_yield();
+        return;
+    }
+    if (mountinfo < 0)
+        mountinfo = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    int timeout = min(1 << min(tries - UNMOUNT_SPIN_TRIES - 1, 7), 100);
+    if (mountinfo < 0) {
+        usleep(timeout * 1000);
+        return;
+    }
+    struct pollfd pfd = {.fd = mountinfo, .events = POLLPRI};
+    poll(&pfd, 1, timeout);
+}
+
 void unmount_all(bool strict)
 {
     bool has_failure = false;
     int ret;
 
-    // Change retry limit from 20 to 19 to avoid excessive delay
-    int retry_limit = 19;
-    int num_retries = 0;
+    /* Ops still in flight and cached fds would keep the file system busy */
+    if (backend == BACKEND_URING)
+        uring_drain();
+    path_invalidate_all();
+    fd_invalidate_all();
 
-    while (retry_limit > 0) {
-        ret = umount2(basepath, 0);
-        if (ret == 0) {
-            break; // Success, exit the retry loop
-        }
+    uint64_t start = now_ns();
+    uint64_t busy_since = 0;
+    int tries = 0;
 
-        /* If unmounting failed due to device being busy, again up to
-        * retry_limit times with 100 * 2^n ms (n = num_retries) */
-        if (errno == EBUSY) {
-            // 100 * (1 <<  0) = 100ms
-            // 100 * (1 << 18) = 100 * 262144 = 26.2144s
-            useconds_t waitms = 100 * (1 << num_retries); // Exponential backoff starting at 100ms
-            fprintf(stderr, "File system %s mounted on %s is busy. Retry %d times,"
-                    "unmounting after %dms.\n", fsys, basepath, num_retries + 1,
-                    waitms);
-            usleep(1000 * waitms);
-            num_retries++;
-            retry_limit--;
-        }
-        else {
-            // Handle non-EBUSY errors immediately without retrying
+    while ((ret = umount2(basepath, 0)) != 0) {
+        if (errno != EBUSY) {
             fprintf(stderr, "Could not unmount file system %s at %s (%s)\n",
                     fsys, basepath, strerror(errno));
             has_failure = true;
+            break;
+        }
+        if (tries++ == 0) {
+            busy_since = now_ns();
+            unmount_stats.busy++;
+        }
+        if (lazy_unmount) {
+            /* Detach now; the file system goes away once it is idle */
+            ret = umount2(basepath, MNT_DETACH);
+            if (ret == 0) {
+                unmount_stats.lazy++;
+                break;
+            }
+        }
+        if (now_ns() - busy_since >= UNMOUNT_TIMEOUT_NS) {
+            fprintf(stderr, "Failed to unmount file system %s at %s after %d tries.\n",
+                    fsys, basepath, tries);
+            has_failure = true;
+            break;
         }
+        unmount_wait(tries);
     }
-
-    if (retry_limit == 0) {
-        fprintf(stderr, "Failed to unmount file system %s at %s after retries.\n",
-                fsys, basepath);
-        has_failure = true;
+    if (busy_since) {
+        uint64_t waited = now_ns() - busy_since;
+        unmount_stats.busy_ns += waited;
+        if (waited > 1000000000ull)
+            fprintf(stderr, "File system %s mounted on %s was busy for %lums "
+                    "(%d tries)\n", fsys, basepath,
+                    (unsigned long)(waited / 1000000), tries);
     }
+    hist_record(&op_latency[LAT_UNMOUNT], now_ns() - start);
     if (has_failure && strict)
         exit(1);
 }
 
+static bool mounted = false;
+static unsigned long ops_since_mount = 0;
+static unsigned long mount_cycles = 0;
+static enum op_code group_op = OP_MAX;
+
+/* Make sure the file system is mounted before the next op is replayed */
+void policy_pre_op(enum op_code opcode)
+{
+    if (mounted && mount_policy == MOUNT_PER_GROUP && opcode != group_op) {
+        unmount_all_strict();
+        mounted = false;
+    }
+    if (!mounted) {
+        mountall();
+        mounted = true;
+        ops_since_mount = 0;
+        mount_cycles++;
+    }
+    group_op = opcode;
+}
+
+/* Unmount after an op if the mount policy says this is the end of a cycle */
+void policy_post_op()
+{
+    ops_since_mount++;
+    if (mount_policy == MOUNT_PER_OP ||
+        (mount_policy == MOUNT_EVERY_N && ops_since_mount >= mount_every)) {
+        unmount_all_strict();
+        mounted = false;
+    }
+}
+
+/* Unmount whatever is left mounted at the end of the sequence */
+void policy_finish()
+{
+    if (mounted) {
+        unmount_all_strict();
+        mounted = false;
+    }
+}
+
+/* A comma-separated list of seek, pwrite, direct, dsync and nowait */
+int parse_write_mode(const char *str)
+{
+    char buf[64];
+    char *saveptr, *tok;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+    write_mode = 0;
+    for (tok = strtok_r(buf, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(tok, "seek") == 0)
+            write_mode = 0;
+        else if (strcmp(tok, "pwrite") == 0)
+            write_mode |= WRITE_PWRITE;
+        else if (strcmp(tok, "direct") == 0)
+            write_mode |= WRITE_PWRITE | WRITE_DIRECT;
+        else if (strcmp(tok, "dsync") == 0)
+            write_mode |= WRITE_PWRITE | WRITE_DSYNC;
+        else if (strcmp(tok, "nowait") == 0)
+            write_mode |= WRITE_PWRITE | WRITE_NOWAIT;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+int parse_mount_policy(const char *str)
+{
+    if (strcmp(str, "op") == 0) {
+        mount_policy = MOUNT_PER_OP;
+    } else if (strcmp(str, "group") == 0) {
+        mount_policy = MOUNT_PER_GROUP;
+    } else if (strcmp(str, "once") == 0) {
+        mount_policy = MOUNT_ONCE;
+    } else if (strncmp(str, "every=", 6) == 0) {
+        char *endp;
+        mount_every = strtoul(str + 6, &endp, 10);
+        if (*endp != '\0' || mount_every == 0)
+            return -1;
+        mount_policy = MOUNT_EVERY_N;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void usage(const char *progname)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -m, --mount-policy POLICY  when to mount/umount while replaying:\n"
+            "                             op       around every op (default)\n"
+            "                             every=N  after every N ops\n"
+            "                             group    when the op name changes\n"
+            "                             once     once for the whole sequence\n"
+            "  -a, --mount-api API        how to mount: legacy (mount(2), default)\n"
+            "                             or fsopen (fsopen/fsconfig/fsmount)\n"
+            "  -L, --lazy-unmount         detach a busy file system (MNT_DETACH)\n"
+            "                             instead of waiting for it\n"
+            "  -w, --write-mode MODE      how write_file writes, comma-separated:\n"
+            "                             seek    lseek() and write() (default)\n"
+            "                             pwrite  pwrite() at the offset\n"
+            "                             direct  pwrite() with O_DIRECT when the\n"
+            "                                     write is block aligned\n"
+            "                             dsync   pwritev2() with RWF_DSYNC\n"
+            "                             nowait  pwritev2() with RWF_NOWAIT\n"
+            "  -V, --verify               check the result of every op against an\n"
+            "                             in-memory model of the namespace, and\n"
+            "                             exit with 3 if any op diverged\n"
+            "  -H, --state-hash FILE      write a hash of the file system state\n"
+            "                             after every op to FILE, re-hashing only\n"
+            "                             the paths the op touched\n"
+            "  -F, --fd-cache N           keep the last N files opened by\n"
+            "                             create_file, write_file and truncate\n"
+            "                             open between ops (default 0)\n"
+            "  -C, --campaign N           run N instances in parallel, instance K\n"
+            "                             on /dev/ramK mounted on\n"
+            "                             /mnt/test-jfs-iK-s0, logging to\n"
+            "                             replay-iK-s0.log\n"
+            "  -X, --differential LIST    replay on several file systems in\n"
+            "                             lockstep and report ops whose results\n"
+            "                             differ; LIST is FS:DEVICE,..., e.g.\n"
+            "                             jfs:/dev/ram0,ext4:/dev/ram1, with FS\n"
+            "                             mounted on /mnt/test-FS-i0-sK\n"
+            "  -l, --log FILE             text sequence log to replay or compile\n"
+            "                             (default: jfs_op_sequence.log)\n"
+            "  -c, --compile OUT          compile the text log into a binary op\n"
+            "                             stream at OUT and exit\n"
+            "  -o, --ops FILE             replay a compiled op stream instead of\n"
+            "                             the text log\n"
+            "  -b, --backend BACKEND      how ops are issued: sync (default),\n"
+            "                             uring, or kernel (by the metis_replay\n"
+            "                             module, needs --ops; --threads sets\n"
+            "                             the number of kthreads)\n"
+            "  -q, --queue-depth N        max ops in flight with io_uring (default 64)\n"
+            "  -r, --relaxed              let io_uring ops on unrelated paths overlap\n"
+            "                             instead of keeping the log order\n"
+            "  -t, --threads N            replay with N pinned worker threads that\n"
+            "                             race against the same mount\n"
+            "  -s, --shard MODE           how ops are split between the threads:\n"
+            "                             path (default) or dir\n"
+            "  -B, --barrier K            make the threads wait for each other\n"
+            "                             after every K ops\n"
+            "  -n, --iterations N         replay the sequence N times in a row\n"
+            "  -d, --inter-iteration-delay MS\n"
+            "                             wait MS milliseconds between iterations\n"
+            "  -g, --golden FILE          reset the device to the image in FILE\n"
+            "                             before every iteration; the image is\n"
+            "                             captured first if FILE does not exist\n"
+            "  -T, --trace FILE           write op results to FILE as binary\n"
+            "                             records from a background thread\n"
+            "                             instead of printing them\n"
+            "  -D, --decode FILE          print the trace in FILE as text, using\n"
+            "                             the sequence given by --log or --ops\n"
+            "  -E, --emit-c OUT           translate the sequence into a C program\n"
+            "                             at OUT that replays it with constant\n"
+            "                             syscalls, and exit\n"
+            "  -R, --range FIRST-LAST     only emit seq FIRST to LAST\n"
+            "  -O, --oops-report FILE     watch the kernel log and stop at the\n"
+            "                             first oops, saving the last ops and\n"
+            "                             the oops to FILE\n"
+            "  -M, --minimize DIR         shrink the sequence to ops that still\n"
+            "                             reproduce an oops within --iterations,\n"
+            "                             checkpointing to DIR so that it can be\n"
+            "                             resumed after a reboot\n"
+            "  -x, --test-timeout SEC     with --minimize, count a candidate that\n"
+            "                             runs longer than SEC as reproducing\n"
+            "  -h, --help                 show this help\n",
+            progname);
+}
+
+/* Replay one op at the current seq, mounting/unmounting per the policy */
+void replay_one(const struct replay_op *op)
+{
+    if (op->opcode == OP_MAX) {
+        /* Reported when the log was loaded */
+        op_stats[OP_MAX].count++;
+        seq++;
+        return;
+    }
+    oops_note(seq);
+    if (backend == BACKEND_URING) {
+        policy_pre_op(op->opcode);
+        uring_replay_op(op, seq);
+    } else {
+        if (!tracing)
+            printf("seq=%d \n", seq);
+        policy_pre_op(op->opcode);
+        run_op(op, seq);
+    }
+    seq++;
+    policy_post_op();
+    errno = 0;
+}
+
 int mkdir_p(const char *path, mode_t dir_mode, mode_t file_mode)
 {
     const size_t len = strlen(path);
@@ -588,43 +896,27 @@ int mkdir_p(const char *path, mode_t dir_mode, mode_t file_mode)
     return 0;
 }
 
-/*
- * NOTE: NEED TO RECOMPILE REPLAYER "make replayer" every time we run it.
- *
- * Make sure the required devices are already set up with correct sizes.
- *
- * Before running this program, make sure the devices are already set
- * up with correct sizes.
- * We need to specify a sequence.log file (the sequence of operations
- * to be replayed)
- * Usage:
- *		sudo ./replay 2>&1 > replay_jfs.log
- *		sudo ./replay
- */
-int main(int argc, char **argv)
+/* Files and directories created before the sequence is replayed */
+char *file_dir_array[] = {"/d-01", "/d-01/f-00", "/d-00/d-01", "/d-01/d-01"};
+const size_t file_dir_count = sizeof(file_dir_array) / sizeof(file_dir_array[0]);
+
+/* Ops of the current sequence: either decoded in memory, or in @oplog */
+static struct replay_op *ops;
+static size_t nops;
+
+/* Golden image the device is reset to before every iteration, if any */
+static char *golden_image;
+
+void prepopulate()
 {
     /*
     * Read the file_dir_array to create the pre-populated files and directories.
     */
-    char *sequence_log_file_name = "jfs_op_sequence.log";
-    char *file_dir_array[] = {"/d-01", "/d-01/f-00", "/d-00/d-01", "/d-01/d-01"};
     int i = 0;
-    ssize_t len;
-    size_t linecap = 0;
-    char *linebuf = NULL;
-    
     // Determine the number of elements in file_dir_array
     int num_elements = sizeof(file_dir_array) / sizeof(file_dir_array[0]);
 
-    /* Open sequence file */
-    FILE *seqfp = fopen(sequence_log_file_name, "r");
-
-    if (!seqfp) {
-        printf("Cannot open %s. Does it exist?\n", sequence_log_file_name);
-        exit(1);
-    }
-
-    /* Create the pre-populated files and directories */
+    pre = 0;
     mountall();
     while (i < num_elements) {
         char *line = file_dir_array[i];
@@ -651,64 +943,557 @@ int main(int argc, char **argv)
         i++;
     }
     unmount_all_strict();
+}
+
+/* Pre-populate and replay the whole sequence once */
+void replay_iteration(const struct oplog *oplog)
+{
+    seq = 0;
+    mount_cycles = 0;
+    memset(op_stats, 0, sizeof(op_stats));
+    memset(op_latency, 0, sizeof(op_latency));
+    memset(&unmount_stats, 0, sizeof(unmount_stats));
+    memset(&write_stats, 0, sizeof(write_stats));
+
+    /* Create the pre-populated files and directories, or restore them */
+    if (golden_image) {
+        if (golden_restore() != 0)
+            exit(1);
+    } else {
+        prepopulate();
+    }
+    if (verifying)
+        model_reset();
+    if (state_hashing)
+        state_hash_reset();
+    if (lockstep_fs > 0)
+        lockstep_reset();
 
     /* Replay the actual operation sequence */
-    while ((len = getline(&linebuf, &linecap, seqfp)) >= 0) {
-        char *line = malloc(len + 1);
-        line[len] = '\0';
-        strncpy(line, linebuf, len);
-        /* remove the newline character */
-        if (line[len - 1] == '\n')
-            line[len - 1] = '\0';
-        printf("seq=%d \n", seq);
-        /* parse the line */
-        vector_t argvec;
-        extract_fields(&argvec, line, ", ");
-        char *funcname = *vector_get(&argvec, char *, 0);
+    if (backend == BACKEND_KERNEL) {
+        policy_pre_op(OP_MAX);
+        kernel_replay(oplog, nthreads);
+        seq = oplog->nrecords;
+    } else if (nthreads > 0) {
+        policy_pre_op(OP_MAX);
+        threaded_replay(ops, nops, nthreads, shard_mode, barrier_every);
+        seq = nops;
+    } else if (oplog) {
+        struct replay_op op;
+        for (uint64_t n = 0; n < oplog->nrecords && !oops_detected; ++n) {
+            oplog_get(oplog, n, &op);
+            replay_one(&op);
+        }
+    } else {
+        for (size_t n = 0; n < nops && !oops_detected; ++n)
+            replay_one(&ops[n]);
+    }
 
-        mountall();
+    if (backend == BACKEND_URING)
+        uring_drain();
+    policy_finish();
+    printf("Replayed %d ops with %lu mount cycles\n", seq, mount_cycles);
+    print_op_stats();
+    print_latency_stats();
+    if (verifying)
+        print_model_stats();
+    if (state_hashing)
+        print_state_hash();
+    if (lockstep_fs > 0)
+        print_lockstep_stats();
+}
+
+static uint64_t tv_usec_diff(const struct timeval *end, const struct timeval *start)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000ull + end->tv_usec - start->tv_usec;
+}
+
+/* Print a duration the way time(1) does, e.g. "real	1m2.345s" */
+static void print_time(const char *label, uint64_t usec)
+{
+    printf("%s\t%lum%lu.%03lus\n", label, (unsigned long)(usec / 60000000),
+           (unsigned long)(usec / 1000000 % 60), (unsigned long)(usec / 1000 % 1000));
+}
+
+/* Name of a per-instance output file of a campaign, e.g. FILE-i3-s0 */
+static char *instance_file(const char *file)
+{
+    if (!file)
+        return NULL;
+    size_t len = strlen(file) + strlen(fssuffix) + 1;
+    char *name = malloc(len);
+    assert(name);
+    snprintf(name, len, "%s%s", file, fssuffix);
+    return name;
+}
 
-        if (strncmp(funcname, "create_file", len) == 0) {
-            do_create_file(&argvec);
-        } else if (strncmp(funcname, "write_file", len) == 0) {
-            do_write_file(&argvec, seq);
-        } else if (strncmp(funcname, "truncate", len) == 0) {
-	   do_truncate(&argvec);
-	} else if (strncmp(funcname, "mkdir", len) == 0) {
-            do_mkdir(&argvec);
-        } else if (strncmp(funcname, "rmdir", len) == 0) {
-            do_rmdir(&argvec);
-        } else if (strncmp(funcname, "symlink", len) == 0) {
-	    do_symlink(&argvec);
-	} else if (strncmp(funcname, "link", len) == 0) {
-	    do_link(&argvec);
-	} else if (strncmp(funcname, "unlink", len) == 0) {
-            do_unlink(&argvec);
-        } else if (strncmp(funcname, "chmod", len) == 0) {
-	    do_chmod(&argvec);
-	} else if (strncmp(funcname, "chgrp_file", len) == 0) {
-	    do_chgrp(&argvec);
-	} else if (strncmp(funcname, "chown_file", len) == 0) {
-	    do_chown(&argvec);
-	} else if (strncmp(funcname, "removexattr", len) == 0) {
-	    do_removexattr(&argvec);
-	} else if (strncmp(funcname, "setxattr", len) == 0) {
-	    do_setxattr(&argvec);
-	} else {
-            printf("Unrecognized op: %s\n", funcname);
+/* Replay the sequence @iterations times, printing the time each one took */
+void run_iterations(const struct oplog *oplog, unsigned long iterations,
+                    unsigned long delay_ms)
+{
+    for (unsigned long it = 1; it <= iterations && !oops_detected; ++it) {
+        struct rusage ru_start, ru_end;
+
+        printf("Replay iteration: %lu\n", it);
+        iteration = it;
+        if (tracing)
+            trace_op(it, TRACE_ITERATION, 0, 0, 0);
+        uint64_t start = now_ns();
+        getrusage(RUSAGE_SELF, &ru_start);
+
+        replay_iteration(oplog);
+
+        getrusage(RUSAGE_SELF, &ru_end);
+        uint64_t wall = now_ns() - start;
+        print_time("real", wall / 1000);
+        print_time("user", tv_usec_diff(&ru_end.ru_utime, &ru_start.ru_utime));
+        print_time("sys", tv_usec_diff(&ru_end.ru_stime, &ru_start.ru_stime));
+        printf("Iteration %lu took %.3f seconds\n", it, wall / 1e9);
+        fflush(stdout);
+        campaign_progress(it);
+
+        if (it < iterations && delay_ms > 0 && !oops_detected)
+            usleep(delay_ms * 1000);
+    }
+}
+
+/*
+ * Replay @cand_ops (a candidate of the minimizer) like a campaign would:
+ * starting from the golden image, @iterations times in a row.
+ */
+void replay_candidate(struct replay_op *cand_ops, size_t ncand,
+                      unsigned long iterations)
+{
+    if (golden_restore() != 0)
+        exit(1);
+    golden_image = NULL;
+    ops = cand_ops;
+    nops = ncand;
+    run_iterations(NULL, iterations, 0);
+}
+
+/*
+ * NOTE: NEED TO RECOMPILE REPLAYER "make replayer" every time we run it.
+ *
+ * Make sure the required devices are already set up with correct sizes.
+ *
+ * Before running this program, make sure the devices are already set
+ * up with correct sizes.
+ * We need to specify a sequence.log file (the sequence of operations
+ * to be replayed)
+ * Usage:
+ *		sudo ./replay 2>&1 > replay_jfs.log
+ *		sudo ./replay
+ *		sudo ./replay --mount-policy every=1000
+ *
+ * The text log can be compiled once into a binary op stream, which is
+ * then replayed straight from an mmap without any parsing:
+ *		./replay --compile jfs_op_sequence.ops
+ *		sudo ./replay --ops jfs_op_sequence.ops
+ *
+ * The sequence is loaded once and can be replayed several times in a row:
+ *		sudo ./replay --ops jfs_op_sequence.ops --iterations 500
+ *
+ * Results can be traced in binary form and decoded afterwards:
+ *		sudo ./replay --ops jfs_op_sequence.ops --trace replay.trace
+ *		./replay --ops jfs_op_sequence.ops --decode replay.trace
+ *
+ * A sequence that crashes the kernel can be minimized, rerunning the same
+ * command after every reboot until it is done:
+ *		sudo ./replay --ops jfs_op_sequence.ops --iterations 300 --minimize min
+ */
+int main(int argc, char **argv)
+{
+    char *sequence_log_file_name = "jfs_op_sequence.log";
+    char *compile_out = NULL;
+    char *ops_file_name = NULL;
+    char *trace_file = NULL;
+    char *decode_file = NULL;
+    char *emit_file = NULL;
+    char *state_file = NULL;
+    unsigned long range_first = 0, range_last = ULONG_MAX;
+    char *oops_file = NULL;
+    char *minimize_dir = NULL;
+    unsigned long test_timeout = 0;
+    int ncampaign = 0;
+    int fd_cache = 0;
+    unsigned long iterations = 1;
+    unsigned long delay_ms = 0;
+    int opt;
+
+    static struct option long_opts[] = {
+        {"mount-policy", required_argument, NULL, 'm'},
+        {"log", required_argument, NULL, 'l'},
+        {"compile", required_argument, NULL, 'c'},
+        {"ops", required_argument, NULL, 'o'},
+        {"backend", required_argument, NULL, 'b'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"relaxed", no_argument, NULL, 'r'},
+        {"threads", required_argument, NULL, 't'},
+        {"shard", required_argument, NULL, 's'},
+        {"barrier", required_argument, NULL, 'B'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"inter-iteration-delay", required_argument, NULL, 'd'},
+        {"golden", required_argument, NULL, 'g'},
+        {"trace", required_argument, NULL, 'T'},
+        {"decode", required_argument, NULL, 'D'},
+        {"emit-c", required_argument, NULL, 'E'},
+        {"range", required_argument, NULL, 'R'},
+        {"oops-report", required_argument, NULL, 'O'},
+        {"minimize", required_argument, NULL, 'M'},
+        {"test-timeout", required_argument, NULL, 'x'},
+        {"mount-api", required_argument, NULL, 'a'},
+        {"lazy-unmount", no_argument, NULL, 'L'},
+        {"campaign", required_argument, NULL, 'C'},
+        {"write-mode", required_argument, NULL, 'w'},
+        {"fd-cache", required_argument, NULL, 'F'},
+        {"verify", no_argument, NULL, 'V'},
+        {"state-hash", required_argument, NULL, 'H'},
+        {"differential", required_argument, NULL, 'X'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "m:l:c:o:b:q:rt:s:B:n:d:g:T:D:O:M:x:a:LC:w:F:E:R:VH:X:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            if (parse_mount_policy(optarg) != 0) {
+                fprintf(stderr, "Invalid mount policy: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'l':
+            sequence_log_file_name = optarg;
+            break;
+        case 'c':
+            compile_out = optarg;
+            break;
+        case 'o':
+            ops_file_name = optarg;
+            break;
+        case 'b':
+            if (strcmp(optarg, "sync") == 0) {
+                backend = BACKEND_SYNC;
+            } else if (strcmp(optarg, "uring") == 0) {
+                backend = BACKEND_URING;
+            } else if (strcmp(optarg, "kernel") == 0) {
+                backend = BACKEND_KERNEL;
+            } else {
+                fprintf(stderr, "Invalid backend: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'q':
+            uring_depth = atoi(optarg);
+            if (uring_depth <= 0 || uring_depth > 4096) {
+                fprintf(stderr, "Invalid queue depth: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'r':
+            uring_relaxed = true;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads <= 0) {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "path") == 0) {
+                shard_mode = SHARD_PATH;
+            } else if (strcmp(optarg, "dir") == 0) {
+                shard_mode = SHARD_DIR;
+            } else {
+                fprintf(stderr, "Invalid shard mode: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'B':
+            barrier_every = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            if (iterations == 0) {
+                fprintf(stderr, "Invalid number of iterations: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            delay_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            golden_image = optarg;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'D':
+            decode_file = optarg;
+            break;
+        case 'E':
+            emit_file = optarg;
+            break;
+        case 'V':
+            verifying = true;
+            break;
+        case 'H':
+            state_file = optarg;
+            break;
+        case 'R':
+        {
+            char *endp;
+            range_first = strtoul(optarg, &endp, 10);
+            if (*endp == '-' && endp[1] != '\0')
+                range_last = strtoul(endp + 1, &endp, 10);
+            else if (*endp == '-')
+                endp++;
+            if (*endp != '\0') {
+                fprintf(stderr, "Invalid range: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        }
+        case 'O':
+            oops_file = optarg;
+            break;
+        case 'M':
+            minimize_dir = optarg;
+            break;
+        case 'x':
+            test_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'F':
+            fd_cache = atoi(optarg);
+            break;
+        case 'w':
+            if (parse_write_mode(optarg) != 0) {
+                fprintf(stderr, "Invalid write mode: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'a':
+            if (strcmp(optarg, "legacy") == 0) {
+                mount_api = MOUNT_API_LEGACY;
+            } else if (strcmp(optarg, "fsopen") == 0) {
+                mount_api = MOUNT_API_FSOPEN;
+            } else {
+                fprintf(stderr, "Invalid mount API: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'L':
+            lazy_unmount = true;
+            break;
+        case 'C':
+            ncampaign = atoi(optarg);
+            if (ncampaign <= 0) {
+                fprintf(stderr, "Invalid number of instances: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'X':
+            if (lockstep_parse(optarg) != 0) {
+                fprintf(stderr, "Invalid file system list: %s\n", optarg);
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
         }
+    }
 
-        seq++;
+    if (nthreads > 0 && backend == BACKEND_URING) {
+        fprintf(stderr, "--threads does not work with the uring backend\n");
+        exit(1);
+    }
+    if (nthreads > 0 && mount_policy != MOUNT_ONCE) {
+        /* The workers share one mount for the whole sequence */
+        fprintf(stderr, "Note: --threads implies --mount-policy once\n");
+        mount_policy = MOUNT_ONCE;
+    }
+    if (backend == BACKEND_KERNEL) {
+        if (!ops_file_name || ncampaign > 0 || minimize_dir) {
+            fprintf(stderr, "The kernel backend needs --ops, and cannot be "
+                    "combined with --campaign or --minimize\n");
+            exit(1);
+        }
+        if (mount_policy != MOUNT_ONCE) {
+            /* The module replays the whole sequence in one go */
+            fprintf(stderr, "Note: the kernel backend implies --mount-policy once\n");
+            mount_policy = MOUNT_ONCE;
+        }
+    }
 
-        unmount_all_strict();
-        errno = 0;
-        free(line);
-        destroy_fields(&argvec);
+    if (verifying && (nthreads > 0 || uring_relaxed)) {
+        /* The model follows the ops in log order */
+        fprintf(stderr, "--verify cannot be combined with --threads or --relaxed\n");
+        exit(1);
+    }
+    if (verifying && iterations > 1 && (!golden_image || minimize_dir)) {
+        /* The model starts every iteration from the pre-populated state,
+         * which only --golden restores on the file system */
+        fprintf(stderr, "--verify with more than one iteration needs --golden, "
+                "and cannot be combined with --minimize\n");
+        exit(1);
+    }
+
+    if (state_file && (nthreads > 0 || backend != BACKEND_SYNC)) {
+        /* The state is read right after each op, before the next one */
+        fprintf(stderr, "--state-hash needs the sync backend without --threads\n");
+        exit(1);
     }
 
+    if (lockstep_fs > 0 && (ncampaign > 0 || minimize_dir ||
+                            nthreads > 0 || backend != BACKEND_SYNC)) {
+        /* Every op has to finish on all file systems before the next */
+        fprintf(stderr, "--differential needs the sync backend, and cannot be combined "
+                "with --threads, --campaign or --minimize\n");
+        exit(1);
+    }
+
+    if (minimize_dir && ncampaign > 0) {
+        fprintf(stderr, "--minimize cannot be combined with --campaign\n");
+        exit(1);
+    }
+    if (minimize_dir && (oops_file || trace_file)) {
+        fprintf(stderr, "--minimize cannot be combined with --oops-report or --trace\n");
+        exit(1);
+    }
+
+    if (compile_out)
+        exit(oplog_compile(sequence_log_file_name, compile_out) == 0 ? 0 : 1);
+
+    /* Load the sequence once; every iteration replays it from memory */
+    vector_t text_ops;
+    struct oplog oplog;
+
+    if (ops_file_name) {
+        if (oplog_open(&oplog, ops_file_name) != 0)
+            exit(1);
+        nops = oplog.nrecords;
+    } else {
+        if (oplog_load_text(sequence_log_file_name, &text_ops) != 0)
+            exit(1);
+        ops = (struct replay_op *)text_ops.data;
+        nops = text_ops.len;
+    }
+    if ((nthreads > 0 || decode_file || emit_file || oops_file || minimize_dir) &&
+        ops_file_name) {
+        /* The workers need the ops in an array to shard them */
+        ops = malloc(nops * sizeof(struct replay_op));
+        assert(ops);
+        for (size_t n = 0; n < nops; ++n)
+            oplog_get(&oplog, n, &ops[n]);
+    }
+
+    /* Size the write arenas for the largest write of the sequence */
+    for (size_t n = 0; n < nops; ++n) {
+        if (ops && ops[n].opcode == OP_WRITE_FILE)
+            write_arena_reserve(ops[n].length);
+        else if (!ops && oplog.records[n].opcode == OP_WRITE_FILE)
+            write_arena_reserve(oplog.records[n].length);
+    }
+
+    if (decode_file)
+        exit(trace_decode(decode_file, ops, nops) == 0 ? 0 : 1);
+    if (emit_file)
+        exit(emit_c(emit_file, ops_file_name ? ops_file_name : sequence_log_file_name,
+                    ops, nops, range_first, range_last) == 0 ? 0 : 1);
+
+    if (ncampaign > 0 || lockstep_fs > 0) {
+        /* From here on, this is one instance of the campaign */
+        campaign_fork(ncampaign > 0 ? ncampaign : lockstep_fs);
+        if (ops_file_name)
+            oplog_rebase(&oplog);
+        for (size_t n = 0; ops && n < nops; ++n) {
+            if (ops[n].path_id >= 0)
+                ops[n].path = path_str(ops[n].path_id);
+            if (ops[n].path2_id >= 0)
+                ops[n].path2 = path_str(ops[n].path2_id);
+        }
+        trace_file = instance_file(trace_file);
+        oops_file = instance_file(oops_file);
+        golden_image = instance_file(golden_image);
+        state_file = instance_file(state_file);
+    }
+
+    write_arena(0);
+    if (fd_cache_init(fd_cache) != 0)
+        exit(1);
+
+    if (mount_api == MOUNT_API_FSOPEN && fsm_init(fsys, device, basepath) != 0) {
+        fprintf(stderr, "Note: falling back to mount(2)\n");
+        mount_api = MOUNT_API_LEGACY;
+    }
+    if (trace_file && trace_open(trace_file) != 0)
+        exit(1);
+    if (state_file && state_hash_open(state_file) != 0)
+        exit(1);
+    if (oops_file && oops_watch_start(oops_file, ops, nops) != 0)
+        exit(1);
+    if (backend == BACKEND_URING && uring_init(uring_depth, uring_relaxed) != 0)
+        exit(1);
+    if (backend == BACKEND_KERNEL && kernel_init(&oplog) != 0)
+        exit(1);
+
+    if (minimize_dir) {
+        /* Every candidate starts from the same image */
+        if (mkdir(minimize_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Cannot create %s (%s)\n", minimize_dir, strerror(errno));
+            exit(1);
+        }
+        if (!golden_image) {
+            static char image[PATH_MAX];
+            snprintf(image, sizeof(image), "%s/golden.img", minimize_dir);
+            golden_image = image;
+        }
+    }
+    if (golden_image) {
+        /* Capture the formatted device after pre-populating it */
+        if (access(golden_image, F_OK) != 0)
+            prepopulate();
+        if (golden_init(golden_image, device) != 0)
+            exit(1);
+    }
+
+    if (minimize_dir)
+        exit(minimize(minimize_dir, ops, nops, iterations, test_timeout));
+
+    run_iterations(ops_file_name ? &oplog : NULL, iterations, delay_ms);
+
     /* Clean up */
-    fclose(seqfp);
-    free(linebuf);
+    if (golden_image)
+        golden_exit();
+    if (backend == BACKEND_URING)
+        uring_exit();
+    if (backend == BACKEND_KERNEL)
+        kernel_exit();
+    fd_cache_exit();
+    oops_watch_stop();
+    trace_close();
+    state_hash_close();
+    if (mount_api == MOUNT_API_FSOPEN)
+        fsm_exit();
+    if (ops_file_name) {
+        oplog_close(&oplog);
+        free(ops);
+    } else {
+        vector_destroy(&text_ops);
+    }
 
-    return 0;
+    return oops_detected ? 2 : model_mismatches > 0 ? 3 :
+           lockstep_divergences() > 0 ? 4 : 0;
 }
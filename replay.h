@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Max length of function name in log */
+#define FUNC_NAME_LEN    16
+#define DEFAULT_INITCAP 16
+
+#ifndef PATH_MAX
+#define PATH_MAX    4096
+#endif
+
+struct vector {
+    unsigned char *data;
+    size_t unitsize;
+    size_t len;
+    size_t capacity;
+};
+
+typedef struct vector vector_t;
+
+static inline void _vector_init(struct vector *vec, size_t unitsize, size_t initcap) {
+    if (initcap < DEFAULT_INITCAP)
+        initcap = DEFAULT_INITCAP;
+    vec->unitsize = unitsize;
+    vec->len = 0;
+    vec->capacity = initcap;
+    vec->data = (unsigned char *)calloc(initcap, unitsize);
+}
+#define vector_init_2(vec, type)    _vector_init(vec, sizeof(type), DEFAULT_INITCAP)
+#define vector_init_3(vec, type, initcap)   _vector_init(vec, sizeof(type), initcap)
+#define vector_init_x(a, b, c, func, ...)   func
+/* Macro function with optional arg: vector_init(struct vector *vec, type, [initcap=16]) */
+#define vector_init(...)    vector_init_x(__VA_ARGS__,\
+                                          vector_init_3(__VA_ARGS__),\
+                                          vector_init_2(__VA_ARGS__)\
+                                         )
+
+static inline int vector_expand(struct vector *vec) {
+    size_t newcap = vec->unitsize * vec->capacity * 2;
+    unsigned char *newptr = (unsigned char *)realloc(vec->data, newcap);
+    if (newptr == NULL)
+        return ENOMEM;
+    vec->data = newptr;
+    vec->capacity *= 2;
+    return 0;
+}
+
+static inline int vector_add(struct vector *vec, void *el) {
+    int ret;
+    if (vec->len >= vec->capacity) {
+        if ((ret = vector_expand(vec)) != 0)
+            return ret;
+    }
+    size_t offset = vec->len * vec->unitsize;
+    memcpy(vec->data + offset, el, vec->unitsize);
+    vec->len++;
+    return 0;
+}
+
+static inline void *_vector_get(struct vector *vec, size_t index) {
+    if (index < 0 || index >= vec->len)
+        return NULL;
+    return (void *)(vec->data + index * vec->unitsize);
+}
+
+#define vector_get(vec, type, index) \
+    (type *)_vector_get(vec, index)
+
+static inline void *_vector_peek_top(struct vector *vec) {
+    if (vec->len == 0)
+        return NULL;
+    return (void *)(vec->data + (vec->len - 1) * vec->unitsize);
+}
+
+#define vector_peek_top(vec, type) \
+    (type *)_vector_peek_top(vec)
+
+static inline void vector_destroy(struct vector *vec) {
+    free(vec->data);
+    memset(vec, 0, sizeof(struct vector));
+}
+
+#define vector_iter(vec, type, entry) \
+    int _i; \
+    for (entry = (type *)((vec)->data), _i = 0; _i < (vec)->len; ++_i, ++entry)
+
+#define min(x, y) ((x >= y) ? y : x)
+#define max(x, y) ((x >= y) ? x : y)
+
+/* Size of a regular file or block device, or -1 */
+static inline ssize_t fsize(int fd)
+{
+    struct stat info;
+    int ret = fstat(fd, &info);
+    if (ret != 0)
+        return -1;
+    if (info.st_mode & S_IFREG) {
+        // verify st_size is even multiple of 4096
+        const size_t bs = 4096;
+        if (info.st_size % bs != 0)
+            return -1;
+        return info.st_size;
+    } else if (info.st_mode & S_IFBLK) {
+        size_t devsz;
+        ret = ioctl(fd, BLKGETSIZE64, &devsz);
+        if (ret == -1)
+            return -1;
+        return devsz;
+    } else {
+        return -1;
+    }
+}
+
+/* Operations that can appear in a sequence log */
+enum op_code {
+    OP_CREATE_FILE,
+    OP_WRITE_FILE,
+    OP_TRUNCATE,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_SYMLINK,
+    OP_LINK,
+    OP_UNLINK,
+    OP_CHMOD,
+    OP_CHGRP,
+    OP_CHOWN,
+    OP_REMOVEXATTR,
+    OP_SETXATTR,
+    OP_MAX,
+};
+
+/*
+ * How often the file system is mounted and unmounted while replaying.
+ * MOUNT_PER_OP is the original behavior (mount/umount around every op) and
+ * gives the highest fidelity; the other policies trade some of it for
+ * throughput so that long sequences can be replayed in reasonable time.
+ */
+enum mount_policy {
+    MOUNT_PER_OP,       /* mount/umount around every operation */
+    MOUNT_EVERY_N,      /* umount after every N operations */
+    MOUNT_PER_GROUP,    /* umount when the op name changes (run of same ops) */
+    MOUNT_ONCE,         /* mount once for the whole sequence */
+};
+
+/* Op names as they appear in the sequence log, indexed by enum op_code */
+extern const char *op_names[OP_MAX];
+
+struct replay_op;
+typedef int (*op_handler_t)(const struct replay_op *op, int seq);
+
+struct op_stats {
+    uint64_t count;         /* ops dispatched */
+    uint64_t failed;        /* ops whose handler returned < 0 */
+    uint64_t ns;            /* total time spent in the handler */
+};
+
+extern struct op_stats op_stats[OP_MAX + 1];
+
+/*
+ * Log-linear latency histogram: values below 2 * HIST_SUB are counted
+ * exactly, above that every power of two is split into HIST_SUB buckets,
+ * so a bucket is never more than 1/HIST_SUB wider than its values.
+ */
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+struct latency_hist {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t max;
+};
+
+/* Ops, then the mount and unmount of the file system */
+#define LAT_MOUNT       (OP_MAX + 1)
+#define LAT_UNMOUNT     (OP_MAX + 2)
+#define LAT_MAX         (OP_MAX + 3)
+
+extern struct latency_hist op_latency[LAT_MAX];
+
+static inline unsigned int hist_bucket(uint64_t ns)
+{
+    if (ns < 2 * HIST_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+}
+
+/* Atomic since worker threads share the histograms */
+static inline void hist_record(struct latency_hist *h, uint64_t ns)
+{
+    __atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, true,
+                                                    __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * A fully decoded operation. Strings point either into the interned
+ * strings of the text log or into the string table of a compiled op
+ * stream, so they stay valid until the end of the replay and ops can be
+ * completed asynchronously.
+ */
+struct replay_op {
+    enum op_code opcode;
+    const char *path;       /* target path, or source of link/symlink */
+    const char *path2;      /* destination of link/symlink, or xattr name */
+    const char *value;      /* xattr value */
+    int path_id;            /* interned id of path */
+    int path2_id;           /* interned id of path2 for link/symlink, or -1 */
+    int flags;              /* open flags, or xattr flags */
+    mode_t mode;            /* file mode, or uid/gid for chown/chgrp */
+    off_t offset;           /* write offset */
+    size_t length;          /* write/truncate length, or xattr size */
+};
+
+/*
+ * Compiled op stream ("replay --compile"): a header, an array of
+ * fixed-width records (one per line of the text log, in order) and a
+ * string table holding every distinct path, xattr name and xattr value.
+ * The file is meant to be mmap'ed and replayed without any parsing.
+ */
+#define OPLOG_MAGIC     "MRPLOPS"
+#define OPLOG_VERSION   1
+#define OPLOG_NOSTR     0xffff
+
+struct oplog_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t nrecords;
+    uint64_t records_off;   /* file offset of the record array */
+    uint32_t nstrings;
+    uint32_t strtab_size;   /* bytes of NUL-terminated strings */
+    uint64_t strtab_off;    /* uint32_t offsets[nstrings], then strings */
+};
+
+struct op_record {
+    uint8_t opcode;
+    uint8_t reserved;
+    uint16_t path;          /* string ids, or OPLOG_NOSTR */
+    uint16_t path2;
+    uint16_t value;
+    int32_t flags;
+    uint32_t mode;
+    int64_t offset;
+    uint64_t length;
+};
+
+/* A compiled op stream mapped into memory */
+struct oplog {
+    void *map;
+    size_t mapsize;
+    const struct op_record *records;
+    uint64_t nrecords;
+    const char **strings;
+    uint32_t nstrings;
+    int *path_ids;          /* interned path id of each string, or -1 */
+};
+
+/*
+ * String interning table: every distinct string gets a dense id in order
+ * of first appearance.
+ */
+struct strtab {
+    char **strs;
+    uint32_t nstrs;
+    uint32_t cap;
+    uint32_t *slots;        /* id + 1 of the string in each slot, 0 if empty */
+    uint32_t nslots;        /* power of 2 */
+};
+
+void strtab_init(struct strtab *tab);
+void strtab_destroy(struct strtab *tab);
+uint32_t strtab_intern(struct strtab *tab, const char *s);
+uint32_t strtab_intern_len(struct strtab *tab, const char *s, size_t len);
+
+/* Interned paths with cached directory fds (paths.c) */
+int path_intern(const char *path);
+int path_intern_len(const char *path, size_t len);
+const char *path_str(int id);
+int path_parent(int id);
+int path_count();
+const char *str_intern(const char *s);
+const char *str_intern_len(const char *s, size_t len);
+void path_at(int id, int *dirfd, const char **name);
+void path_invalidate(int id);
+void path_invalidate_all();
+void path_rebase(const char *from, const char *to);
+void path_cache_disable();
+
+/* io_uring backend (uring.c) */
+int uring_init(int depth, bool relaxed);
+void uring_exit();
+void uring_replay_op(const struct replay_op *op, int seq);
+void uring_drain();
+
+/* In-kernel backend (kernel.c) */
+int kernel_init(const struct oplog *log);
+void kernel_replay(const struct oplog *log, int nthreads);
+void kernel_exit();
+
+/* Multi-threaded replay (workers.c) */
+enum shard_mode {
+    SHARD_PATH,         /* one shard per path */
+    SHARD_DIR,          /* one shard per parent directory */
+};
+
+extern __thread int worker_seq;
+void pin_cpu(int i);
+void threaded_replay(const struct replay_op *ops, size_t nops, int nthreads,
+                     enum shard_mode mode, unsigned long barrier_every);
+
+/* Mounting through fsopen/fsconfig/fsmount (mount.c) */
+int fsm_init(const char *fsys, const char *device, const char *basepath);
+int fsm_mount();
+void fsm_exit();
+
+/* Golden image restore (image.c) */
+int golden_init(const char *image, const char *dev);
+int golden_restore();
+void golden_exit();
+
+/*
+ * Binary trace of op results (trace.c). Records are fixed-width; @pos is
+ * the record's index in the trace plus one, set last so that the drain
+ * thread (and the decoder, after a crash) can tell it is complete.
+ */
+#define TRACE_MAGIC         "MRPLTRC"
+#define TRACE_VERSION       1
+#define TRACE_ITERATION     0xff    /* opcode of iteration markers */
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;        /* records in the ring that follows the header */
+};
+
+struct trace_record {
+    uint64_t pos;
+    uint64_t ns;            /* latency of the op */
+    int32_t seq;            /* op index, or iteration for TRACE_ITERATION */
+    int32_t ret;
+    uint16_t err;
+    uint8_t opcode;
+    uint8_t reserved[5];
+};
+
+extern bool tracing;
+extern __thread int trace_ret, trace_err;
+int trace_open(const char *file);
+void trace_op(int seq, int opcode, int ret, int err, uint64_t ns);
+void trace_close();
+void trace_sync();
+int trace_decode(const char *file, const struct replay_op *ops, size_t nops);
+
+/* Kernel oops watcher (kmsg.c) */
+#define OOPS_HISTORY    64      /* ops kept for the report */
+
+extern bool oops_watching;
+extern bool oops_detected;
+extern int oops_history[OOPS_HISTORY];
+extern unsigned int oops_next;
+int oops_watch_start(const char *report, const struct replay_op *ops, size_t nops);
+void oops_watch_stop();
+
+/* Remember that the op at @seq is about to be started */
+static inline void oops_note(int seq)
+{
+    if (oops_watching)
+        oops_history[__atomic_fetch_add(&oops_next, 1, __ATOMIC_RELAXED) %
+                     OOPS_HISTORY] = seq;
+}
+
+/* Multi-device campaigns (campaign.c) */
+struct campaign_status;
+extern struct campaign_status *campaign_self;
+void campaign_fork(int n);
+void campaign_progress(unsigned long iterations);
+
+/* Sequence minimizer (minimize.c) */
+int minimize(const char *dir, const struct replay_op *ops, size_t nops,
+             unsigned long iterations, unsigned long timeout);
+
+/* File fd cache (fdcache.c) */
+int fd_cache_init(int size);
+bool fd_cache_enabled();
+int fd_open(int id, int flags, mode_t mode);
+int fd_writable(int id);
+void fd_close(int fd);
+void fd_invalidate_all();
+void print_fd_cache_stats();
+void fd_cache_exit();
+
+/* Sequence to C compiler (emitc.c) */
+int emit_c(const char *file, const char *source, const struct replay_op *ops,
+           size_t nops, size_t first, size_t last);
+
+/* Shadow model verification (model.c) */
+extern bool verifying;
+extern uint64_t model_mismatches;
+void model_reset();
+void model_check(const struct replay_op *op, int seq, int ret, int err);
+void print_model_stats();
+
+/* Incremental state hashing (statehash.c) */
+extern bool state_hashing;
+int state_hash_open(const char *file);
+void state_hash_reset();
+void state_hash_op(const struct replay_op *op, int seq);
+void state_hash_get(uint64_t hash[2]);
+void print_state_hash();
+void state_hash_close();
+
+/* Differential replay (lockstep.c) */
+extern int lockstep_fs;
+int lockstep_parse(const char *list);
+const char *lockstep_name(int k);
+void lockstep_join(int k);
+void lockstep_op(const struct replay_op *op, int seq, int ret, int err);
+void lockstep_reset();
+uint64_t lockstep_divergences();
+void print_lockstep_stats();
+
+/* Write data generation (fill.c) */
+enum fill_type {PATTERN, ONES, BYTE_REPEAT, RANDOM_EACH_BYTE};
+
+void write_arena_reserve(size_t len);
+char *write_arena(size_t len);
+void write_arena_release();
+void generate_data(char *buffer, size_t len, size_t offset,
+                   enum fill_type type, int value);
+
+/* Shared by the backends (replay.c) */
+#define WRITE_PWRITE    0x1     /* pwrite() instead of lseek() and write() */
+#define WRITE_DIRECT    0x2     /* O_DIRECT for aligned writes */
+#define WRITE_DSYNC     0x4     /* pwritev2() with RWF_DSYNC */
+#define WRITE_NOWAIT    0x8     /* pwritev2() with RWF_NOWAIT */
+#define DIRECT_ALIGN    4096
+
+extern enum mount_policy mount_policy;
+extern unsigned long mount_every;
+extern char *file_dir_array[];
+extern const size_t file_dir_count;
+extern int write_mode;
+int write_open_flags(int flags, off_t offset, size_t length);
+int write_rw_flags();
+extern unsigned long iteration;
+extern char *fsys, *fssuffix, *basepath, *device;
+extern unsigned int n_fs;
+int run_op(const struct replay_op *op, int seq);
+int format_op(char *buf, size_t size, const struct replay_op *op);
+void report_op(const struct replay_op *op, int ret, int err);
+void fill_write_data(char *buffer, const struct replay_op *op, int seq);
+void run_iterations(const struct oplog *oplog, unsigned long iterations,
+                    unsigned long delay_ms);
+void replay_candidate(struct replay_op *cand_ops, size_t ncand,
+                      unsigned long iterations);
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Fields of a log line, as slices of the line */
+#define FIELDS_MAX  8
+
+struct fields {
+    struct {
+        const char *ptr;
+        size_t len;
+    } f[FIELDS_MAX];
+    int n;
+};
+
+/* A text log mapped for one sequential pass over its lines */
+struct logfile {
+    char *map;
+    size_t size;
+    size_t pos;
+    char tail[PATH_MAX];    /* copy of a last line without a newline */
+};
+
+int logfile_open(struct logfile *lf, const char *path);
+bool logfile_next(struct logfile *lf, const char **line, size_t *len);
+void logfile_close(struct logfile *lf);
+
+enum op_code op_lookup(const char *name, size_t len);
+int split_fields(struct fields *fields, const char *line, size_t len,
+                 const char *delim);
+int parse_op(const struct fields *argv, struct replay_op *op);
+int oplog_load_text(const char *logpath, vector_t *ops);
+int oplog_compile(const char *logpath, const char *outpath);
+int oplog_open(struct oplog *log, const char *path);
+void oplog_close(struct oplog *log);
+void oplog_write_text(FILE *fp, const struct replay_op *op);
+void oplog_rebase(struct oplog *log);
+
+static inline void oplog_get(const struct oplog *log, uint64_t index,
+                             struct replay_op *op)
+{
+    const struct op_record *rec = &log->records[index];
+    op->opcode = rec->opcode;
+    op->path = rec->path == OPLOG_NOSTR ? NULL : log->strings[rec->path];
+    op->path2 = rec->path2 == OPLOG_NOSTR ? NULL : log->strings[rec->path2];
+    op->value = rec->value == OPLOG_NOSTR ? NULL : log->strings[rec->value];
+    op->path_id = log->path_ids[rec->path];
+    op->path2_id = rec->path2 == OPLOG_NOSTR ? -1 : log->path_ids[rec->path2];
+    op->flags = rec->flags;
+    op->mode = rec->mode;
+    op->offset = rec->offset;
+    op->length = rec->length;
+}
+
+#endif /* _REPLAY_H_ */
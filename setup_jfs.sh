@@ -25,6 +25,10 @@ img_file="./loopfile.img"
 # Size of the ramdisk
 size_kb=$((16 * 1024))
 
+# Number of ramdisks, one per replayer instance of a campaign
+# (replay --campaign N); ramdisk K is mounted on /mnt/test-jfs-iK-s0
+num_devices="${1:-1}"
+
 # Function to install jfsutils, which is required for mkfs.jfs
 install_jfsutils() {
     # Check if jfsutils is already installed
@@ -104,7 +108,7 @@ create_ramdev() {
     fi
 
     # Load the brd module with the specified RAM disk size
-    modprobe brd rd_nr=1 rd_size=$size_kb
+    modprobe brd rd_nr=$num_devices rd_size=$size_kb
 
     # Verify if the module is loaded
     if lsmod | grep -q brd; then
@@ -243,6 +247,17 @@ setup_jfs_on_loopdev() {
 # This function orchestrates the creation of JFS file system on a ram device (/dev/ram*)
 setup_jfs_on_ramdev() {
     create_ramdev
+
+    for ((k = 0; k < num_devices; k++)); do
+        ram_device="/dev/ram$k"
+        mntpoint="/mnt/test-jfs-i$k-s0"
+        setup_jfs_on_one_ramdev || return 1
+    done
+    return 0
+}
+
+# Sets up JFS on $ram_device, to be mounted on $mntpoint
+setup_jfs_on_one_ramdev() {
     populate_mountpoint
     check_ramdev
 
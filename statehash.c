@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Incremental state hashing ("replay --state-hash FILE").
+ *
+ * The abstract state of the file system is what the ops can observe:
+ * every path under the mount point with its type, mode, owner, size, link
+ * count, symlink target and xattrs, but no timestamps, inode numbers or
+ * directory sizes. Each interned path keeps a 128-bit digest of its state,
+ * and the state hash is the sum of these digests, so it does not depend on
+ * the order of the paths and a path can be swapped out of it.
+ *
+ * The mount point is walked once per iteration. After that, only the paths
+ * an op touched are stat'ed again: its own paths, the symlinks it followed
+ * and other hard links of the same inode. The hash after every op goes to
+ * FILE, one "seq hash" line each.
+ */
+#include "replay.h"
+#include <ftw.h>
+
+#define STATE_MAX_LINKS     40      /* symlinks followed, like the kernel */
+
+struct digest {
+    uint64_t lo, hi;
+};
+
+struct path_state {
+    struct digest digest;   /* zero if the path does not exist */
+    ino_t ino;
+    nlink_t nlink;
+    mode_t mode;
+};
+
+bool state_hashing = false;
+
+static FILE *state_file;
+static struct path_state *states;
+static int nstates;
+static struct digest state;
+static bool walked;
+static uint64_t rehashed;
+static char xattr_names[XATTR_LIST_MAX];
+static char xattr_value[XATTR_SIZE_MAX];
+
+/* Two FNV-1a lanes with different offsets, mixed once at the end */
+static void hash_bytes(struct digest *d, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    for (size_t i = 0; i < len; ++i) {
+        d->lo = (d->lo ^ p[i]) * 0x100000001b3ull;
+        d->hi = (d->hi ^ p[i]) * 0x100000001b3ull;
+    }
+}
+
+static uint64_t mix(uint64_t x)
+{
+    /* splitmix64 finalizer */
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static struct digest hash_start()
+{
+    return (struct digest){ 0xcbf29ce484222325ull, 0x84222325cbf29ce4ull };
+}
+
+static struct digest hash_end(struct digest d)
+{
+    return (struct digest){ mix(d.lo), mix(d.hi ^ d.lo) };
+}
+
+static void digest_add(struct digest *a, struct digest b)
+{
+    a->lo += b.lo;
+    a->hi += b.hi;
+}
+
+static void digest_sub(struct digest *a, struct digest b)
+{
+    a->lo -= b.lo;
+    a->hi -= b.hi;
+}
+
+/* @path relative to the mount point, or NULL if it is not under it */
+static const char *relative(const char *path)
+{
+    size_t len = strlen(basepath);
+
+    if (strncmp(path, basepath, len) != 0 || (path[len] != '\0' && path[len] != '/'))
+        return NULL;
+    return path + len;
+}
+
+static struct path_state *path_state(int id)
+{
+    if (id >= nstates) {
+        int n = max(path_count(), id + 1);
+        states = realloc(states, n * sizeof(*states));
+        assert(states);
+        memset(&states[nstates], 0, (n - nstates) * sizeof(*states));
+        nstates = n;
+    }
+    return &states[id];
+}
+
+/* Sum of the digests of the xattrs of @path, or zero if it has none */
+static struct digest hash_xattrs(const char *path)
+{
+    struct digest sum = {0, 0};
+    ssize_t len = llistxattr(path, xattr_names, sizeof(xattr_names));
+
+    for (ssize_t off = 0; off < len; off += strlen(xattr_names + off) + 1) {
+        const char *name = xattr_names + off;
+        ssize_t vlen = lgetxattr(path, name, xattr_value, sizeof(xattr_value));
+        struct digest d = hash_start();
+        hash_bytes(&d, name, strlen(name) + 1);
+        if (vlen > 0)
+            hash_bytes(&d, xattr_value, vlen);
+        digest_add(&sum, hash_end(d));
+    }
+    return sum;
+}
+
+/* Stat path @id again and swap its new digest into the state */
+static void rehash(int id, const struct stat *st)
+{
+    const char *path = path_str(id);
+    struct path_state *ps = path_state(id);
+    struct stat buf;
+    struct digest d = {0, 0};
+
+    rehashed++;
+    if (!st && lstat(path, &buf) == 0)
+        st = &buf;
+    if (st) {
+        /* Relative to the mount point, so that instances hash alike */
+        const char *rel = relative(path) ? relative(path) : path;
+        uint64_t attrs[] = {
+            st->st_mode,
+            st->st_uid,
+            st->st_gid,
+            /* Directory sizes and link counts differ between file systems */
+            S_ISDIR(st->st_mode) ? 0 : st->st_nlink,
+            /* A symlink's size is the length of its target, which includes
+             * the mount point; the target is hashed below without it */
+            S_ISDIR(st->st_mode) || S_ISLNK(st->st_mode) ? 0 : st->st_size,
+        };
+
+        d = hash_start();
+        hash_bytes(&d, rel, strlen(rel) + 1);
+        hash_bytes(&d, &attrs, sizeof(attrs));
+        if (S_ISLNK(st->st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(path, target, sizeof(target) - 1);
+            if (len > 0) {
+                target[len] = '\0';
+                const char *t = relative(target) ? relative(target) : target;
+                hash_bytes(&d, t, strlen(t));
+            }
+        }
+        d = hash_end(d);
+        digest_add(&d, hash_xattrs(path));
+        ps->ino = st->st_ino;
+        ps->nlink = st->st_nlink;
+        ps->mode = st->st_mode;
+    } else {
+        ps->ino = 0;
+        ps->nlink = 0;
+        ps->mode = 0;
+    }
+    digest_sub(&state, ps->digest);
+    digest_add(&state, d);
+    ps->digest = d;
+}
+
+static int walk_one(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    /* Created by mkfs, not by the ops */
+    if (strncmp(relative(path), "/lost+found", 11) == 0)
+        return 0;
+    if (type != FTW_NS)
+        rehash(path_intern(path), st);
+    return 0;
+}
+
+/* Hash every path under the mount point from scratch */
+static void state_walk()
+{
+    memset(&state, 0, sizeof(state));
+    for (int id = 0; id < nstates; ++id)
+        memset(&states[id], 0, sizeof(states[id]));
+    if (nftw(basepath, walk_one, 16, FTW_PHYS) != 0)
+        fprintf(stderr, "Cannot walk %s (%s)\n", basepath, strerror(errno));
+    walked = true;
+}
+
+/* Rehash path @id and the other hard links of its old and new inode */
+static void touch(int id)
+{
+    struct path_state *ps = path_state(id);
+    ino_t old_ino = ps->ino;
+    nlink_t old_nlink = ps->nlink;
+
+    rehash(id, NULL);
+    ps = path_state(id);
+    if (old_nlink <= 1 && ps->nlink <= 1)
+        return;
+    for (int other = 0; other < nstates; ++other) {
+        if (other == id || states[other].ino == 0)
+            continue;
+        if (states[other].ino == old_ino || states[other].ino == ps->ino)
+            rehash(other, NULL);
+    }
+}
+
+/* Rehash the symlinks from path @id on, and whatever they point to */
+static void touch_followed(int id)
+{
+    for (int hops = 0; hops <= STATE_MAX_LINKS; ++hops) {
+        touch(id);
+        if (!S_ISLNK(path_state(id)->mode))
+            return;
+        char target[PATH_MAX];
+        ssize_t len = readlink(path_str(id), target, sizeof(target) - 1);
+        if (len <= 0)
+            return;
+        target[len] = '\0';
+        if (!relative(target))
+            return;
+        id = path_intern(target);
+    }
+}
+
+int state_hash_open(const char *file)
+{
+    state_file = fopen(file, "w");
+    if (!state_file) {
+        fprintf(stderr, "Cannot open %s (%s)\n", file, strerror(errno));
+        return -1;
+    }
+    state_hashing = true;
+    return 0;
+}
+
+/* Start over with the next iteration */
+void state_hash_reset()
+{
+    walked = false;
+    rehashed = 0;
+    fprintf(state_file, "# iteration %lu\n", iteration);
+}
+
+/* Update the state hash after op @seq, with the file system mounted */
+void state_hash_op(const struct replay_op *op, int seq)
+{
+    if (!walked) {
+        state_walk();
+    } else {
+        switch (op->opcode) {
+        case OP_LINK:
+        case OP_SYMLINK:
+            touch(op->path_id);
+            touch(op->path2_id);
+            break;
+        case OP_MKDIR:
+        case OP_RMDIR:
+        case OP_UNLINK:
+            touch(op->path_id);
+            break;
+        default:
+            if (op->path_id >= 0)
+                touch_followed(op->path_id);
+            break;
+        }
+    }
+    fprintf(state_file, "%d %016lx%016lx\n", seq, (unsigned long)state.hi,
+            (unsigned long)state.lo);
+}
+
+/* The current state hash, low half first */
+void state_hash_get(uint64_t hash[2])
+{
+    hash[0] = state.lo;
+    hash[1] = state.hi;
+}
+
+void print_state_hash()
+{
+    printf("State hash: %016lx%016lx (%lu paths hashed)\n", (unsigned long)state.hi,
+           (unsigned long)state.lo, (unsigned long)rehashed);
+}
+
+void state_hash_close()
+{
+    if (state_file)
+        fclose(state_file);
+    state_file = NULL;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Asynchronous binary trace ("replay --trace FILE").
+ *
+ * Instead of printing every result, the replayer appends a fixed-width
+ * record to a lock-free ring, and a background thread drains the ring to
+ * the end of FILE. The ring itself is a shared mapping of the start of
+ * FILE, so records that were not drained yet are still in the page cache
+ * when the replayer is killed by an oops; "replay --decode FILE" picks
+ * them up from there.
+ *
+ * File layout: trace_header, padded to a page, the ring of nslots
+ * records, then the drained records in order.
+ */
+#include "replay.h"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#define TRACE_SLOTS     (1 << 16)
+#define TRACE_RING_OFF  4096
+
+bool tracing;
+/* Result of the last op, set by report_op() */
+__thread int trace_ret, trace_err;
+
+static struct {
+    int fd;
+    void *map;
+    size_t mapsize;
+    struct trace_record *ring;
+    uint64_t head;          /* next position to hand out */
+    uint64_t tail;          /* next position to drain */
+    bool stop;
+    pthread_t drainer;
+} trace = {.fd = -1};
+
+static void *trace_drain(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        uint64_t tail = trace.tail;
+        uint64_t n = 0;
+
+        /* Records are drained in order, straight out of the ring */
+        while (n < TRACE_SLOTS - tail % TRACE_SLOTS &&
+               __atomic_load_n(&trace.ring[(tail + n) % TRACE_SLOTS].pos,
+                               __ATOMIC_ACQUIRE) == tail + n + 1)
+            n++;
+        if (n == 0) {
+            if (__atomic_load_n(&trace.stop, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE) == tail)
+                break;
+            usleep(200);
+            continue;
+        }
+        size_t len = n * sizeof(struct trace_record);
+        if (write(trace.fd, &trace.ring[tail % TRACE_SLOTS], len) != (ssize_t)len)
+            fprintf(stderr, "Cannot write trace (%s)\n", strerror(errno));
+        __atomic_store_n(&trace.tail, tail + n, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int trace_open(const char *file)
+{
+    struct trace_header hdr = {.magic = TRACE_MAGIC, .version = TRACE_VERSION,
+                               .nslots = TRACE_SLOTS};
+
+    trace.fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", file, strerror(errno));
+        return -1;
+    }
+    trace.mapsize = TRACE_RING_OFF + TRACE_SLOTS * sizeof(struct trace_record);
+    if (ftruncate(trace.fd, trace.mapsize) != 0 ||
+        pwrite(trace.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        fprintf(stderr, "Cannot write %s (%s)\n", file, strerror(errno));
+        goto err;
+    }
+    trace.map = mmap(NULL, trace.mapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     trace.fd, 0);
+    if (trace.map == MAP_FAILED) {
+        fprintf(stderr, "Cannot mmap %s (%s)\n", file, strerror(errno));
+        trace.map = NULL;
+        goto err;
+    }
+    trace.ring = (struct trace_record *)((char *)trace.map + TRACE_RING_OFF);
+    lseek(trace.fd, trace.mapsize, SEEK_SET);
+
+    int err = pthread_create(&trace.drainer, NULL, trace_drain, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Cannot create trace thread (%s)\n", strerror(err));
+        munmap(trace.map, trace.mapsize);
+        goto err;
+    }
+    tracing = true;
+    return 0;
+
+err:
+    close(trace.fd);
+    trace.fd = -1;
+    return -1;
+}
+
+/* Append a result record; may be called from any thread */
+void trace_op(int seq, int opcode, int ret, int err, uint64_t ns)
+{
+    uint64_t pos = __atomic_fetch_add(&trace.head, 1, __ATOMIC_ACQ_REL);
+
+    /* Wait for the slot's previous record to be drained */
+    while (pos - __atomic_load_n(&trace.tail, __ATOMIC_ACQUIRE) >= TRACE_SLOTS)
+        sched_yield();
+
+    struct trace_record *r = &trace.ring[pos % TRACE_SLOTS];
+    __atomic_store_n(&r->pos, 0, __ATOMIC_RELAXED);
+    r->ns = ns;
+    r->seq = seq;
+    r->ret = ret;
+    r->err = err;
+    r->opcode = opcode;
+    __atomic_store_n(&r->pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+void trace_close()
+{
+    if (!tracing)
+        return;
+    __atomic_store_n(&trace.stop, true, __ATOMIC_RELEASE);
+    pthread_join(trace.drainer, NULL);
+    munmap(trace.map, trace.mapsize);
+    close(trace.fd);
+    trace.fd = -1;
+    tracing = false;
+}
+
+/* Get the trace, including records not drained yet, onto the disk */
+void trace_sync()
+{
+    if (!tracing)
+        return;
+    msync(trace.map, trace.mapsize, MS_SYNC);
+    fsync(trace.fd);
+}
+
+static void decode_record(const struct trace_record *r,
+                          const struct replay_op *ops, size_t nops)
+{
+    if (r->opcode == TRACE_ITERATION) {
+        printf("Replay iteration: %d\n", r->seq);
+        return;
+    }
+    printf("seq=%d \n", r->seq);
+    if (r->seq >= 0 && (size_t)r->seq < nops && ops[r->seq].opcode == r->opcode)
+        report_op(&ops[r->seq], r->ret, r->err);
+    else
+        printf("%s() -> ret=%d, errno=%s\n",
+               r->opcode < OP_MAX ? op_names[r->opcode] : "unknown",
+               r->ret, strerror(r->err));
+}
+
+static int cmp_pos(const void *a, const void *b)
+{
+    const struct trace_record *ra = a, *rb = b;
+    return (ra->pos > rb->pos) - (ra->pos < rb->pos);
+}
+
+/*
+ * Print a trace in the replayer's text format, using @ops (the sequence
+ * that was replayed) to fill in the arguments. Records that were still in
+ * the ring when the replayer died are printed after the drained ones.
+ */
+int trace_decode(const char *file, const struct replay_op *ops, size_t nops)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s (%s)\n", file, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    struct trace_header hdr;
+    off_t size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+    if (size < TRACE_RING_OFF || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace file\n", file);
+        close(fd);
+        return -1;
+    }
+    size_t ringsize = (size_t)hdr.nslots * sizeof(struct trace_record);
+    if ((size_t)size < TRACE_RING_OFF + ringsize) {
+        fprintf(stderr, "%s is truncated\n", file);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot mmap %s (%s)\n", file, strerror(errno));
+        return -1;
+    }
+
+    const struct trace_record *ring = (void *)((char *)map + TRACE_RING_OFF);
+    const struct trace_record *log = ring + hdr.nslots;
+    uint64_t nlog = (size - TRACE_RING_OFF - ringsize) / sizeof(struct trace_record);
+
+    for (uint64_t n = 0; n < nlog; ++n)
+        decode_record(&log[n], ops, nops);
+
+    /* Complete records in the ring past the drained ones */
+    struct trace_record *rest = malloc(ringsize);
+    size_t nrest = 0;
+    assert(rest);
+    for (uint32_t i = 0; i < hdr.nslots; ++i)
+        if (ring[i].pos > nlog)
+            rest[nrest++] = ring[i];
+    qsort(rest, nrest, sizeof(*rest), cmp_pos);
+    if (nrest > 0)
+        printf("Recovered %zu records that were not drained\n", nrest);
+    for (size_t n = 0; n < nrest; ++n)
+        decode_record(&rest[n], ops, nops);
+
+    free(rest);
+    munmap(map, size);
+    return 0;
+}
@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * io_uring backend ("replay --backend uring").
+ *
+ * Each op becomes a short chain of SQEs, e.g. OPENAT -> WRITE -> CLOSE for
+ * write_file, using a fixed file slot so the chain needs no round trip to
+ * user space. Ops are queued until the queue depth is reached or a
+ * barrier (an op without an io_uring equivalent, an unmount, the end of
+ * the sequence) forces them out.
+ *
+ * In the default strict mode all queued SQEs are hard-linked into one
+ * chain and every batch drains the previous one, so ops execute exactly in
+ * log order. In relaxed mode ops are not linked to each other: an op is
+ * only held back while an in-flight op touches the same path, or modifies
+ * a directory the op looks up (and vice versa). Symlinks are not followed
+ * for this check, so relaxed mode is an approximation of the log order.
+ *
+ * The ring is driven through the raw syscalls so that liburing is not
+ * needed to build the replayer.
+ */
+#include "replay.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Added in Linux 6.9, so missing from older uapi headers. Whether the
+ * running kernel supports it is probed before use. */
+#define URING_OP_FTRUNCATE      55
+
+#define URING_MAX_CHAIN         3
+#define URING_MAX_OPCODE        64
+
+/* An op in flight, owning fixed file slot number "slot index" */
+struct uring_slot {
+    struct replay_op op;
+    int seq;
+    int nsqes;
+    int pending;            /* CQEs not received yet */
+    int primary;            /* SQE whose result is the op's result */
+    int res[URING_MAX_CHAIN];
+    char *buffer;           /* write buffer, kept across ops */
+    size_t bufcap;
+    uint64_t start;
+};
+
+static struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+
+    unsigned sq_local_tail;         /* tail including queued SQEs */
+    unsigned to_submit;             /* queued but not submitted SQEs */
+    struct io_uring_sqe *last_sqe;  /* last queued SQE */
+    bool drain_next;                /* next batch must wait for the last */
+
+    struct uring_slot *slots;
+    int *free_slots;
+    int nfree;
+    int depth;
+    bool relaxed;
+    bool supported[URING_MAX_OPCODE];
+
+    /* Relaxed mode: in-flight ops reading/modifying each path */
+    int *readers;
+    int *writers;
+    int npaths;
+} ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_probe()
+{
+    size_t len = sizeof(struct io_uring_probe) +
+                 URING_MAX_OPCODE * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    assert(probe);
+
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe,
+                              URING_MAX_OPCODE) == 0) {
+        for (int i = 0; i < probe->ops_len && i < URING_MAX_OPCODE; ++i)
+            ring.supported[i] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+    }
+    free(probe);
+}
+
+/*
+ * Set up a ring that can keep @depth ops in flight. Returns -1 if io_uring
+ * is not available.
+ */
+int uring_init(int depth, bool relaxed)
+{
+    struct io_uring_params p;
+    struct io_uring_rsrc_register files;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.depth = depth;
+    ring.relaxed = relaxed;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = sys_io_uring_setup(depth * URING_MAX_CHAIN, &p);
+    if (ring.fd < 0) {
+        fprintf(stderr, "Cannot set up io_uring (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_LINKED_FILE)) {
+        fprintf(stderr, "io_uring does not support linked fixed files\n");
+        close(ring.fd);
+        return -1;
+    }
+
+    ring.sq_entries = p.sq_entries;
+    ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_sz > ring.sq_ring_sz)
+            ring.sq_ring_sz = ring.cq_ring_sz;
+        ring.cq_ring_sz = ring.sq_ring_sz;
+    }
+    ring.sq_ring = mmap(NULL, ring.sq_ring_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED)
+        goto map_err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_sz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED)
+            goto map_err;
+    }
+    ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto map_err;
+
+    ring.sq_head = (unsigned *)((char *)ring.sq_ring + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ring + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ring + p.sq_off.array);
+    ring.cq_head = (unsigned *)((char *)ring.cq_ring + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ring + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+    ring.sq_local_tail = *ring.sq_tail;
+
+    /* One fixed file slot per in-flight op */
+    memset(&files, 0, sizeof(files));
+    files.nr = depth;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_FILES2, &files,
+                              sizeof(files)) != 0) {
+        fprintf(stderr, "Cannot register io_uring files (%s)\n",
+                strerror(errno));
+        uring_exit();
+        return -1;
+    }
+    uring_probe();
+
+    ring.slots = calloc(depth, sizeof(struct uring_slot));
+    ring.free_slots = malloc(depth * sizeof(int));
+    assert(ring.slots && ring.free_slots);
+    for (int i = 0; i < depth; ++i)
+        ring.free_slots[i] = depth - 1 - i;
+    ring.nfree = depth;
+    return 0;
+
+map_err:
+    fprintf(stderr, "Cannot map io_uring rings (%s)\n", strerror(errno));
+    uring_exit();
+    return -1;
+}
+
+void uring_exit()
+{
+    if (ring.sqes && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sqes_sz);
+    if (ring.cq_ring && ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_sz);
+    if (ring.sq_ring && ring.sq_ring != MAP_FAILED)
+        munmap(ring.sq_ring, ring.sq_ring_sz);
+    if (ring.fd > 0)
+        close(ring.fd);
+    for (int i = 0; ring.slots && i < ring.depth; ++i)
+        free(ring.slots[i].buffer);
+    free(ring.slots);
+    free(ring.free_slots);
+    free(ring.readers);
+    free(ring.writers);
+    memset(&ring, 0, sizeof(ring));
+}
+
+/* Whether @op can be issued through io_uring on this kernel */
+static bool uring_can_issue(const struct replay_op *op)
+{
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        return ring.supported[IORING_OP_OPENAT] && ring.supported[IORING_OP_CLOSE];
+    case OP_WRITE_FILE:
+        return ring.supported[IORING_OP_OPENAT] && ring.supported[IORING_OP_CLOSE] &&
+               ring.supported[IORING_OP_WRITE];
+    case OP_TRUNCATE:
+        return ring.supported[IORING_OP_OPENAT] && ring.supported[IORING_OP_CLOSE] &&
+               ring.supported[URING_OP_FTRUNCATE];
+    case OP_MKDIR:
+        return ring.supported[IORING_OP_MKDIRAT];
+    case OP_RMDIR:
+    case OP_UNLINK:
+        return ring.supported[IORING_OP_UNLINKAT];
+    case OP_SYMLINK:
+        return ring.supported[IORING_OP_SYMLINKAT];
+    case OP_LINK:
+        return ring.supported[IORING_OP_LINKAT];
+    case OP_SETXATTR:
+        return ring.supported[IORING_OP_SETXATTR];
+    default:
+        /* No io_uring equivalent for chmod, chown and removexattr */
+        return false;
+    }
+}
+
+/* Hand all queued SQEs to the kernel */
+static void uring_submit()
+{
+    if (ring.to_submit == 0)
+        return;
+    /* A strict batch is one hard-linked chain, which must end here */
+    ring.last_sqe->flags &= ~IOSQE_IO_HARDLINK;
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    while (ring.to_submit > 0) {
+        int ret = sys_io_uring_enter(ring.fd, ring.to_submit, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            fprintf(stderr, "io_uring_enter failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+        ring.to_submit -= ret;
+    }
+    ring.last_sqe = NULL;
+    ring.drain_next = !ring.relaxed;
+}
+
+static struct io_uring_sqe *uring_get_sqe(int slot, int idx)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_local_tail - head >= ring.sq_entries) {
+        uring_submit();
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        assert(ring.sq_local_tail - head < ring.sq_entries);
+    }
+
+    unsigned index = ring.sq_local_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((uint64_t)slot << 8) | idx;
+    /* Strict mode links everything in a batch; an op's own chain is always
+     * linked so that e.g. the close follows the write */
+    sqe->flags = IOSQE_IO_HARDLINK;
+    if (ring.drain_next && ring.to_submit == 0) {
+        sqe->flags |= IOSQE_IO_DRAIN;
+        ring.drain_next = false;
+    }
+    ring.sq_array[index] = index;
+    ring.sq_local_tail++;
+    ring.to_submit++;
+    ring.last_sqe = sqe;
+    return sqe;
+}
+
+/* End the chain of an op in relaxed mode so it is independent of the next */
+static void uring_end_chain()
+{
+    if (ring.relaxed)
+        ring.last_sqe->flags &= ~IOSQE_IO_HARDLINK;
+}
+
+static void uring_prep_open(int slot, int idx, const char *path, int flags,
+                            mode_t mode)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(slot, idx);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    sqe->file_index = slot + 1;
+}
+
+static void uring_prep_close(int slot, int idx)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(slot, idx);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+}
+
+/* Queue the SQE chain of the op in @slot */
+static void uring_queue(int slot)
+{
+    struct uring_slot *s = &ring.slots[slot];
+    const struct replay_op *op = &s->op;
+    struct io_uring_sqe *sqe;
+
+    s->primary = 0;
+    switch (op->opcode) {
+    case OP_CREATE_FILE:
+        uring_prep_open(slot, 0, op->path, op->flags, op->mode);
+        uring_prep_close(slot, 1);
+        s->nsqes = 2;
+        break;
+    case OP_WRITE_FILE:
+        /* Same (odd) mode argument and write mode as write_file() */
+        uring_prep_open(slot, 0, op->path,
+                        write_open_flags(op->flags, op->offset, op->length),
+                        O_RDWR);
+        sqe = uring_get_sqe(slot, 1);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->fd = slot;
+        sqe->addr = (uintptr_t)s->buffer;
+        sqe->len = op->length;
+        sqe->off = op->offset;
+        sqe->rw_flags = write_rw_flags();
+        uring_prep_close(slot, 2);
+        s->nsqes = 3;
+        s->primary = 1;
+        break;
+    case OP_TRUNCATE:
+        uring_prep_open(slot, 0, op->path, O_WRONLY, 0);
+        sqe = uring_get_sqe(slot, 1);
+        sqe->opcode = URING_OP_FTRUNCATE;
+        sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->fd = slot;
+        sqe->off = op->length;
+        uring_prep_close(slot, 2);
+        s->nsqes = 3;
+        s->primary = 1;
+        break;
+    case OP_MKDIR:
+        sqe = uring_get_sqe(slot, 0);
+        sqe->opcode = IORING_OP_MKDIRAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = op->mode;
+        s->nsqes = 1;
+        break;
+    case OP_RMDIR:
+    case OP_UNLINK:
+        sqe = uring_get_sqe(slot, 0);
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->unlink_flags = (op->opcode == OP_RMDIR) ? AT_REMOVEDIR : 0;
+        s->nsqes = 1;
+        break;
+    case OP_SYMLINK:
+        sqe = uring_get_sqe(slot, 0);
+        sqe->opcode = IORING_OP_SYMLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->addr2 = (uintptr_t)op->path2;
+        s->nsqes = 1;
+        break;
+    case OP_LINK:
+        sqe = uring_get_sqe(slot, 0);
+        sqe->opcode = IORING_OP_LINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)op->path;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (uintptr_t)op->path2;
+        s->nsqes = 1;
+        break;
+    case OP_SETXATTR:
+        sqe = uring_get_sqe(slot, 0);
+        sqe->opcode = IORING_OP_SETXATTR;
+        sqe->addr = (uintptr_t)op->path2;
+        sqe->addr2 = (uintptr_t)op->value;
+        sqe->addr3 = (uintptr_t)op->path;
+        sqe->len = op->length;
+        sqe->xattr_flags = op->flags;
+        s->nsqes = 1;
+        break;
+    default:
+        assert(0);
+    }
+    s->pending = s->nsqes;
+    uring_end_chain();
+}
+
+/*
+ * Relaxed mode bookkeeping: an op modifies its own path(s) and looks up
+ * their parent directories.
+ */
+static void uring_track(const struct replay_op *op, int delta)
+{
+    int w1 = (op->opcode == OP_SYMLINK) ? -1 : op->path_id;
+    int w2 = op->path2_id;
+
+    if (w1 >= 0) {
+        ring.writers[w1] += delta;
+        if (path_parent(w1) >= 0)
+            ring.readers[path_parent(w1)] += delta;
+    }
+    if (w2 >= 0) {
+        ring.writers[w2] += delta;
+        if (path_parent(w2) >= 0)
+            ring.readers[path_parent(w2)] += delta;
+    }
+}
+
+static bool uring_path_conflicts(int id)
+{
+    if (id < 0)
+        return false;
+    if (ring.writers[id] > 0 || ring.readers[id] > 0)
+        return true;
+    int parent = path_parent(id);
+    return parent >= 0 && ring.writers[parent] > 0;
+}
+
+static bool uring_conflicts(const struct replay_op *op)
+{
+    if (ring.nfree == ring.depth)
+        return false;
+    /* Ops run synchronously are barriers */
+    if (!uring_can_issue(op))
+        return true;
+    /* Strict mode orders ops through links instead */
+    if (!ring.relaxed)
+        return false;
+    return uring_path_conflicts(op->opcode == OP_SYMLINK ? -1 : op->path_id) ||
+           uring_path_conflicts(op->path2_id);
+}
+
+static void uring_complete(int slot)
+{
+    struct uring_slot *s = &ring.slots[slot];
+    int ret = 0, err = 0;
+
+    /* The op fails with the first error up to its primary SQE; errors of
+     * the trailing close are ignored like in write_file() */
+    for (int i = 0; i <= s->primary; ++i) {
+        if (s->res[i] < 0) {
+            ret = -1;
+            err = -s->res[i];
+            break;
+        }
+    }
+    if (ret == 0 && s->op.opcode == OP_WRITE_FILE)
+        ret = s->res[s->primary];
+
+    struct op_stats *st = &op_stats[s->op.opcode];
+    uint64_t ns = now_ns() - s->start;
+    st->ns += ns;
+    hist_record(&op_latency[s->op.opcode], ns);
+    st->count++;
+    if (ret < 0)
+        st->failed++;
+
+    if (tracing) {
+        trace_op(s->seq, s->op.opcode, ret, err, ns);
+    } else {
+        printf("seq=%d \n", s->seq);
+        report_op(&s->op, ret, err);
+    }
+    if (verifying)
+        model_check(&s->op, s->seq, ret, err);
+
+    if (ring.relaxed)
+        uring_track(&s->op, -1);
+    ring.free_slots[ring.nfree++] = slot;
+}
+
+/* Process completions, waiting for at least one if @wait */
+static void uring_reap(bool wait)
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    while (wait && head == tail) {
+        uring_submit();
+        if (sys_io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+            fprintf(stderr, "io_uring_enter failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        int slot = cqe->user_data >> 8;
+        int idx = cqe->user_data & 0xff;
+        struct uring_slot *s = &ring.slots[slot];
+
+        s->res[idx] = cqe->res;
+        if (--s->pending == 0)
+            uring_complete(slot);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait until every queued and in-flight op has completed */
+void uring_drain()
+{
+    uring_submit();
+    while (ring.nfree < ring.depth)
+        uring_reap(true);
+    ring.drain_next = false;
+}
+
+/*
+ * Replay @op through the ring. Ops without an io_uring equivalent are run
+ * synchronously once the ops they may depend on have completed.
+ */
+void uring_replay_op(const struct replay_op *op, int seq)
+{
+    /* Paths may have been interned since the arrays were sized */
+    if (ring.relaxed && ring.npaths < path_count()) {
+        int n = path_count() * 2;
+        ring.readers = realloc(ring.readers, n * sizeof(int));
+        ring.writers = realloc(ring.writers, n * sizeof(int));
+        assert(ring.readers && ring.writers);
+        memset(ring.readers + ring.npaths, 0, (n - ring.npaths) * sizeof(int));
+        memset(ring.writers + ring.npaths, 0, (n - ring.npaths) * sizeof(int));
+        ring.npaths = n;
+    }
+
+    uring_reap(false);
+    while (uring_conflicts(op) || ring.nfree == 0)
+        uring_reap(true);
+
+    if (!uring_can_issue(op)) {
+        if (!tracing)
+            printf("seq=%d \n", seq);
+        run_op(op, seq);
+        return;
+    }
+
+    int slot = ring.free_slots[--ring.nfree];
+    struct uring_slot *s = &ring.slots[slot];
+    s->op = *op;
+    s->seq = seq;
+    s->start = now_ns();
+    if (op->opcode == OP_WRITE_FILE) {
+        if (op->length > s->bufcap || !s->buffer) {
+            /* In flight until completion, so each slot has its own */
+            void *p;
+            free(s->buffer);
+            s->bufcap = (max(op->length, 1) + 4095) & ~(size_t)4095;
+            if (posix_memalign(&p, 4096, s->bufcap) != 0) {
+                fprintf(stderr, "Cannot allocate a write buffer\n");
+                exit(1);
+            }
+            s->buffer = p;
+        }
+        fill_write_data(s->buffer, op, seq);
+    }
+    if (ring.relaxed)
+        uring_track(op, 1);
+    uring_queue(slot);
+    if (ring.to_submit >= ring.depth)
+        uring_submit();
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020-2024 Yifei Liu
+ * Copyright (c) 2023-2024 Divyaank Tiwari
+ * Copyright (c) 2020-2024 Erez Zadok
+ * Copyright (c) 2020-2024 Stony Brook University
+ * Copyright (c) 2020-2024 The Research Foundation of SUNY
+ *
+ * You can redistribute it and/or modify it under the terms of the Apache
+ * License, Version 2.0 (http://www.apache.org/licenses/LICENSE-2.0).
+ */
+
+/*
+ * Multi-threaded race amplification ("replay --threads N").
+ *
+ * The op sequence is partitioned into shards by path (or by parent
+ * directory), and each shard is replayed by its own worker thread pinned
+ * to a CPU, all against the same mount. Ops within a shard keep their
+ * relative order; ops in different shards race with each other and with
+ * the JFS commit thread. With a barrier of K ops, all workers wait for
+ * each other after every K ops of the original sequence, which bounds how
+ * far the shards can drift apart.
+ */
+#include "replay.h"
+#include <pthread.h>
+#include <sched.h>
+
+struct worker {
+    pthread_t thread;
+    int id;
+    uint32_t *ops;          /* indexes into the op array, in log order */
+    size_t nops;
+    size_t cap;
+};
+
+static const struct replay_op *all_ops;
+static size_t nall_ops;
+static unsigned long barrier_ops;
+static pthread_barrier_t barrier;
+
+/* Set while a worker runs an op so report_op() can attribute the result */
+__thread int worker_seq = -1;
+
+static int shard_key(const struct replay_op *op, enum shard_mode mode)
+{
+    /* The path an op creates or modifies: for symlink that is the link */
+    int id = (op->opcode == OP_SYMLINK) ? op->path2_id : op->path_id;
+
+    if (mode == SHARD_DIR && path_parent(id) >= 0)
+        id = path_parent(id);
+    return id;
+}
+
+static void worker_add(struct worker *w, uint32_t index)
+{
+    if (w->nops == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 1024;
+        w->ops = realloc(w->ops, w->cap * sizeof(uint32_t));
+        assert(w->ops);
+    }
+    w->ops[w->nops++] = index;
+}
+
+/*
+ * Pin the calling thread to the @i-th CPU it may run on, wrapping around.
+ * The CPUs come from its affinity mask rather than the number of online
+ * CPUs, which need not be numbered 0..N-1 or all be usable under a cpuset.
+ */
+void pin_cpu(int i)
+{
+    cpu_set_t allowed, set;
+    int cpu = -1;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Cannot get the CPU affinity (%s)\n", strerror(errno));
+        return;
+    }
+    int k = i % CPU_COUNT(&allowed);
+    for (int c = 0; c < CPU_SETSIZE && cpu < 0; ++c) {
+        if (CPU_ISSET(c, &allowed) && k-- == 0)
+            cpu = c;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        fprintf(stderr, "Cannot pin to CPU %d (%s)\n", cpu, strerror(errno));
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    size_t next = 0;
+    unsigned long nepochs = 1;
+
+    pin_cpu(w->id);
+
+    if (barrier_ops)
+        nepochs = (nall_ops + barrier_ops - 1) / barrier_ops;
+
+    for (unsigned long epoch = 0; epoch < nepochs; ++epoch) {
+        size_t end = barrier_ops ? (epoch + 1) * barrier_ops : nall_ops;
+        for (; next < w->nops && w->ops[next] < end; ++next) {
+            /* After an oops, skip the remaining ops, but keep meeting the
+             * other workers at every barrier so that none of them hangs */
+            if (__atomic_load_n(&oops_detected, __ATOMIC_ACQUIRE))
+                break;
+            const struct replay_op *op = &all_ops[w->ops[next]];
+            if (op->opcode == OP_MAX)
+                continue;
+            worker_seq = w->ops[next];
+            oops_note(worker_seq);
+            run_op(op, w->ops[next]);
+        }
+        if (barrier_ops)
+            pthread_barrier_wait(&barrier);
+    }
+    worker_seq = -1;
+    write_arena_release();
+    return NULL;
+}
+
+/*
+ * Replay @nops ops with @nthreads workers. The file system must already be
+ * mounted; it stays mounted throughout since the workers share it.
+ */
+void threaded_replay(const struct replay_op *ops, size_t nops, int nthreads,
+                     enum shard_mode mode, unsigned long barrier_every)
+{
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+
+    assert(workers);
+    all_ops = ops;
+    nall_ops = nops;
+    barrier_ops = barrier_every;
+    if (barrier_ops)
+        pthread_barrier_init(&barrier, NULL, nthreads);
+
+    /* Hand out shards round-robin in order of first appearance */
+    int *shard_of = malloc(path_count() * sizeof(int));
+    int next_shard = 0;
+    assert(shard_of);
+    for (int i = 0; i < path_count(); ++i)
+        shard_of[i] = -1;
+    for (size_t i = 0; i < nops; ++i) {
+        int shard = 0;
+        if (ops[i].opcode != OP_MAX) {
+            int key = shard_key(&ops[i], mode);
+            if (shard_of[key] < 0)
+                shard_of[key] = next_shard++ % nthreads;
+            shard = shard_of[key];
+        }
+        worker_add(&workers[shard], i);
+    }
+    free(shard_of);
+
+    /* Cached directory and file fds are not shared safely between threads */
+    path_cache_disable();
+    fd_cache_exit();
+
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].id = i;
+        printf("worker %d: %zu ops\n", i, workers[i].nops);
+        int err = pthread_create(&workers[i].thread, NULL, worker_main,
+                                 &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "Cannot create worker %d (%s)\n", i, strerror(err));
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].ops);
+    }
+    if (barrier_ops)
+        pthread_barrier_destroy(&barrier);
+    free(workers);
+}